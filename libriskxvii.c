@@ -0,0 +1,4618 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <time.h>
+#include "riskxvii.h"
+
+// Hot basic blocks are compiled to native code on x86-64 (System V ABI)
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+#define JIT_HOT_THRESHOLD 50
+
+// Regular input files are mapped, everything else is read in blocks
+#if defined(__unix__)
+#define INPUT_MMAP
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#define INPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 65536
+#define DUMP_OUTPUT_MAX (16 + 32 * 20) // the program counter and 32 register lines
+
+// Harts beyond the first run on threads of their own
+#if defined(__unix__) && defined(__GNUC__)
+#define MULTI_HART
+#include <pthread.h>
+#endif
+#define MAX_HARTS 8
+#define HART_QUANTUM 100000
+
+// The profiler times virtual routines in TSC cycles on x86-64
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+#define PROFILE_HOT_SPOTS 20
+#define CALL_GRAPH_MAX_NODES 65536
+#define CALL_GRAPH_MAX_DEPTH 1024
+
+// Heap allocator state and storage. Bank i is free while bit i of
+// free_banks is set. Every bank records the first bank of its allocation
+// and the first bank holds the allocation's length, so free never has to
+// scan.
+struct heap_memory {
+    uint64_t free_banks[2];
+    uint8_t first_bank[128];
+    uint8_t banks_used[128];
+    uint8_t data[128 * 64];
+};
+typedef struct heap_memory HeapMemory;
+
+// Handler ids assigned to each instruction word by the predecoder
+enum instruction_handler {
+    HANDLER_ADD, HANDLER_SUB, HANDLER_XOR, HANDLER_OR, HANDLER_AND,
+    HANDLER_SLL, HANDLER_SRL, HANDLER_SRA, HANDLER_SLT, HANDLER_SLTU,
+    HANDLER_ADDI, HANDLER_XORI, HANDLER_ORI, HANDLER_ANDI, HANDLER_SLTI, HANDLER_SLTIU,
+    HANDLER_LB, HANDLER_LH, HANDLER_LW, HANDLER_LBU, HANDLER_LHU,
+    HANDLER_SB, HANDLER_SH, HANDLER_SW,
+    HANDLER_BEQ, HANDLER_BNE, HANDLER_BLT, HANDLER_BGE, HANDLER_BLTU, HANDLER_BGEU,
+    HANDLER_JAL, HANDLER_JALR, HANDLER_LUI,
+    HANDLER_AMOADD, HANDLER_AMOSWAP, HANDLER_LR, HANDLER_SC, HANDLER_FENCE,
+    // Superinstructions fused at load time
+    HANDLER_LUI_ADDI, HANDLER_LUI_LW, HANDLER_LUI_SW,
+    HANDLER_SLT_BNE, HANDLER_SLT_BEQ, HANDLER_SLTU_BNE, HANDLER_SLTU_BEQ,
+    HANDLER_ADDI_BNE, HANDLER_ADDI_BLT,
+    HANDLER_NOT_IMPLEMENTED,
+    HANDLER_BREAKPOINT, // set by the host over another instruction
+    HANDLER_END_OF_MEMORY,
+    HANDLER_PROFILE // dispatched to before every instruction while profiling or tracing
+};
+
+struct decoded_instruction {
+    uint8_t handler;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int imm; // sign-extended; branch and jump offsets in bytes
+};
+typedef struct decoded_instruction DecodedInstruction;
+
+// Mnemonics by handler id
+const char* handler_names[] = {
+    "add", "sub", "xor", "or", "and",
+    "sll", "srl", "sra", "slt", "sltu",
+    "addi", "xori", "ori", "andi", "slti", "sltiu",
+    "lb", "lh", "lw", "lbu", "lhu",
+    "sb", "sh", "sw",
+    "beq", "bne", "blt", "bge", "bltu", "bgeu",
+    "jal", "jalr", "lui",
+    "amoadd.w", "amoswap.w", "lr.w", "sc.w", "fence",
+    "lui+addi", "lui+lw", "lui+sw",
+    "slt+bne", "slt+beq", "sltu+bne", "sltu+beq",
+    "addi+bne", "addi+blt",
+    "not implemented",
+    "breakpoint",
+    "end of memory",
+    "profile"
+};
+
+struct output_buffer {
+    FILE* stream;
+    char* data;
+    size_t size;
+    size_t used;
+    size_t capacity; // past size only while a non-blocking stream is behind
+    uint8_t nonblocking; // write what the stream takes, park the VM when full
+    uint8_t broken; // the reader went away, output is dropped
+};
+typedef struct output_buffer OutputBuffer;
+
+struct input_reader {
+    FILE* stream;
+    const uint8_t* data; // mapped file or the buffer
+    size_t length;
+    size_t position;
+    size_t mark; // where the current read routine started
+    uint8_t* buffer;
+    size_t capacity;
+    uint8_t mapped;
+    uint8_t at_end;
+    uint8_t nonblocking; // park the VM instead of waiting for input
+    uint8_t fifo;
+    int64_t origin; // input consumed before data[0], for snapshots
+};
+typedef struct input_reader InputReader;
+
+// Run statistics, written as a line of JSON each time the program halts or
+// fails and then started over. Instructions and memory accesses are the
+// first hart's, the heap and console are shared by all of them.
+struct run_stats {
+    FILE* out;
+    uint64_t instructions;
+    unsigned int landing; // where the current straight run of instructions started
+    double seconds; // spent running
+    uint64_t loads[5]; // by page kind
+    uint64_t stores[5];
+    uint64_t allocations;
+    uint64_t failed_allocations;
+    uint64_t frees;
+    int heap_banks; // most banks in use at once
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+};
+typedef struct run_stats RunStats;
+
+enum page_kind {
+    PAGE_UNMAPPED, PAGE_INSTRUCTION, PAGE_DATA, PAGE_VIRTUAL_ROUTINE, PAGE_HEAP
+};
+
+struct virtual_machine;
+struct hart_group;
+struct profile;
+struct trace;
+typedef void (*NativeBlock)(struct virtual_machine* vm);
+
+// Indexed by the instruction the block starts at
+struct basic_block {
+    uint16_t length; // instructions, 0 if no block starts here
+    uint8_t jit_failed;
+    unsigned int entry_count;
+    unsigned int native_runs;
+    NativeBlock native_code;
+    size_t native_size;
+};
+typedef struct basic_block BasicBlock;
+
+struct virtual_machine {
+    unsigned int program_counter;
+    unsigned int registers[32];
+
+    //Memory types
+    uint8_t memory[2048]; // instructions 0x000-0x3ff, data 0x400-0x7ff
+    uint8_t dirty_words[512]; // by address / 4, set once a data word is written
+    //virtual routines 0x800 - 0x8ff
+    HeapMemory heap; // 128 banks of 64 bytes at 0xb700 - 0xd6ff
+
+    OutputBuffer output;
+    InputReader input;
+
+    // Kind of each 256-byte page from 0x0000 to 0xffff
+    uint8_t page_table[256];
+
+    // Instruction memory decoded once at load time, plus a guard entry that
+    // catches execution running off the end of instruction memory
+    DecodedInstruction decoded_instructions[257];
+    BasicBlock basic_blocks[256];
+
+    // Native code for hot blocks
+    uint8_t jit_enabled;
+    uint8_t* jit_code;
+    size_t jit_code_used;
+
+    // Instructions left in the current quantum, charged a block at a time
+    int64_t instruction_budget;
+    // Set by another thread (a failing hart) to end the quantum at the next
+    // block, only ever accessed atomically
+    int stop_requested;
+
+    // Where halts, errors and parking unwind to inside resume_virtual_machine()
+    jmp_buf* exit_point;
+    uint8_t stop_reason;
+    int exit_status;
+
+    // State reset_virtual_machine() returns to, as loaded or restored. The
+    // heap copy is only kept when a restored snapshot had allocations.
+    uint8_t pristine_data[1024];
+    unsigned int pristine_registers[32];
+    unsigned int pristine_program_counter;
+    HeapMemory* pristine_heap;
+
+    // Instruction the breakpoint replaced, and the one before it in case the
+    // two were fused. -1 if there is no breakpoint.
+    int breakpoint;
+    DecodedInstruction breakpoint_saved[2];
+
+    // Edge coverage for fuzzers, NULL when off
+    uint8_t* coverage_map;
+    unsigned int coverage_mask; // map size - 1
+    unsigned int coverage_previous; // id of the last block entered, halved
+
+    // Execution profile, run statistics and trace, NULL when off
+    struct profile* profile;
+    RunStats* stats;
+    struct trace* trace;
+
+    // Harts share the memory, heap and console of the first one, which owns
+    // the others while any are running
+    struct virtual_machine* first_hart; // itself on the first hart
+    struct hart_group* harts;
+    int hart_id;
+    int lock_depth;
+    unsigned int reservation; // address lr.w read, 1 if none
+    unsigned int reserved_value;
+
+    // Host overrides for the virtual routines
+    VirtualRoutineHandler routine_handler;
+    void* routine_context;
+    const char* cache_directory;
+};
+
+// Harts
+//
+// A store to 0x844 starts another hart at the stored address, with a copy
+// of the starting hart's registers. Both get the new hart's id in R[28],
+// the starting hart gets 0 if none could be started, as with non-blocking
+// streams. Harts beyond the first share its memory, heap and console and
+// are only interpreted, each on a thread of its own. Virtual routines run
+// one at a time under the group's lock. A hart halting ends only that hart.
+// The first hart halting or any hart failing stops them all, and the run
+// ends with the first hart.
+#if defined(MULTI_HART)
+struct hart_group {
+    pthread_mutex_t lock;
+    VirtualMachine* harts[MAX_HARTS]; // the first hart's slot is unused
+    pthread_t threads[MAX_HARTS];
+    int count; // harts started so far, slots are not reused
+    int stopping; // set once they are being joined
+    int failed;
+};
+typedef struct hart_group HartGroup;
+#endif
+
+void lock_harts(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    HartGroup* group = vm->first_hart->harts;
+    if (group != NULL && vm->lock_depth++ == 0) {
+        pthread_mutex_lock(&(group->lock));
+    }
+#endif
+}
+
+void unlock_harts(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    if (vm->lock_depth > 0 && --vm->lock_depth == 0) {
+        pthread_mutex_unlock(&(vm->first_hart->harts->lock));
+    }
+#endif
+}
+
+// Before unwinding out of a routine that may hold the lock
+void release_harts(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    if (vm->lock_depth > 0) {
+        vm->lock_depth = 0;
+        pthread_mutex_unlock(&(vm->first_hart->harts->lock));
+    }
+#endif
+}
+
+#if defined(MULTI_HART)
+uint8_t resume_virtual_machine(VirtualMachine* vm, int64_t quantum);
+
+void* run_hart(void* argument) {
+    VirtualMachine* hart = argument;
+    VirtualMachine* first_hart = hart->first_hart;
+    HartGroup* group = first_hart->harts;
+    uint8_t reason;
+    do {
+        reason = resume_virtual_machine(hart, HART_QUANTUM);
+    } while (reason == STOP_QUANTUM_EXPIRED && !__atomic_load_n(&(group->stopping), __ATOMIC_ACQUIRE));
+
+    if (reason == STOP_ERROR) {
+        // The first hart stops at its next block and finds the failure
+        __atomic_store_n(&(group->failed), 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&(first_hart->stop_requested), 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+#endif
+
+void start_hart(VirtualMachine* vm, unsigned int address) {
+    vm->registers[28] = 0;
+#if defined(MULTI_HART)
+    VirtualMachine* first_hart = vm->first_hart;
+    // Parking a VM can't wait for other threads, so the guest sees 0
+    if (first_hart->input.nonblocking || first_hart->output.nonblocking) {
+        return;
+    }
+    if (first_hart->harts == NULL) {
+        HartGroup* group = calloc(1, sizeof(HartGroup));
+        if (group == NULL || pthread_mutex_init(&(group->lock), NULL) != 0) {
+            free(group);
+            return;
+        }
+        group->count = 1;
+        first_hart->harts = group;
+    }
+    HartGroup* group = first_hart->harts;
+    VirtualMachine* hart = group->count < MAX_HARTS ? malloc(sizeof(VirtualMachine)) : NULL;
+    if (hart == NULL) {
+        return;
+    }
+
+    // Only the registers and decoded instructions of the copy are used.
+    // Nothing the starting hart owns may be reached through it.
+    memcpy(hart, vm, sizeof(VirtualMachine));
+    memset(&(hart->output), 0, sizeof(hart->output));
+    memset(&(hart->input), 0, sizeof(hart->input));
+    hart->pristine_heap = NULL;
+    if (hart->breakpoint >= 0) {
+        if (hart->breakpoint > 0) {
+            hart->decoded_instructions[hart->breakpoint - 1] = hart->breakpoint_saved[0];
+        }
+        hart->decoded_instructions[hart->breakpoint] = hart->breakpoint_saved[1];
+        hart->breakpoint = -1;
+    }
+    hart->program_counter = address;
+    hart->hart_id = group->count;
+    hart->registers[28] = hart->hart_id;
+    hart->harts = NULL;
+    hart->lock_depth = 0;
+    hart->reservation = 1;
+    hart->jit_enabled = 0;
+    hart->jit_code = NULL;
+    hart->coverage_map = NULL;
+    hart->profile = NULL;
+    hart->stats = NULL;
+    hart->trace = NULL;
+    hart->exit_point = NULL;
+
+    if (pthread_create(&(group->threads[group->count]), NULL, run_hart, hart) != 0) {
+        free(hart);
+        return;
+    }
+    group->harts[group->count] = hart;
+    group->count++;
+    vm->registers[28] = hart->hart_id;
+#else
+    (void) address;
+#endif
+}
+
+// Stops and joins every hart but the first
+void stop_harts(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    HartGroup* group = vm->harts;
+    if (group == NULL) {
+        return;
+    }
+    __atomic_store_n(&(group->stopping), 1, __ATOMIC_RELEASE);
+    for (int i = 1; i < group->count; i++) {
+        pthread_join(group->threads[i], NULL);
+        free(group->harts[i]);
+    }
+    pthread_mutex_destroy(&(group->lock));
+    free(group);
+    vm->harts = NULL;
+    __atomic_store_n(&(vm->stop_requested), 0, __ATOMIC_RELAXED);
+#endif
+}
+
+// Called when the first hart stops. The other harts are stopped along with
+// it once it halted or failed, and any of them failing fails it too.
+// Returns 1 if they were stopped.
+int check_harts(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    HartGroup* group = vm->harts;
+    if (group == NULL) {
+        return 0;
+    }
+    int failed = __atomic_load_n(&(group->failed), __ATOMIC_ACQUIRE);
+    if (!failed && vm->stop_reason != STOP_HALTED && vm->stop_reason != STOP_ERROR) {
+        return 0;
+    }
+    stop_harts(vm);
+    if (failed) {
+        vm->stop_reason = STOP_ERROR;
+        vm->exit_status = 1;
+    }
+    return 1;
+#else
+    (void) vm;
+    return 0;
+#endif
+}
+
+// Instruction word at an address, as shown in error messages
+unsigned int get_instruction_word(VirtualMachine* vm, unsigned int address) {
+    unsigned int num = 0;
+    if (address <= 1020) {
+        memcpy(&num, vm->memory + (address & ~3u), 4);
+    }
+    return num;
+}
+
+// Console output
+//
+// Guest output is collected in the VM's buffer and written out on halt,
+// before input is read, on register dumps and errors, and when the buffer
+// fills up. A size of 0 writes every value straight through.
+//
+// A non-blocking stream only gets what it takes without waiting and the
+// rest stays buffered. The buffer grows past its size rather than splitting
+// a routine's output, and the output routines park the VM with
+// STOP_OUTPUT_FULL before writing anything while it is that far behind.
+void flush_output(VirtualMachine* vm) {
+    OutputBuffer* output = &(vm->output);
+#if defined(INPUT_MMAP)
+    if (output->nonblocking) {
+        size_t written = 0;
+        while (written < output->used && !output->broken) {
+            ssize_t count = write(fileno(output->stream), output->data + written, output->used - written);
+            if (count > 0) {
+                written += count;
+            } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (count == 0 || errno != EINTR) {
+                output->broken = 1;
+            }
+        }
+        written = output->broken ? output->used : written;
+        memmove(output->data, output->data + written, output->used - written);
+        output->used -= written;
+        return;
+    }
+#endif
+    if (output->used > 0) {
+        fwrite(output->data, 1, output->used, output->stream);
+        output->used = 0;
+    }
+    fflush(output->stream);
+}
+
+void set_output_buffer_size(VirtualMachine* vm, size_t size) {
+    flush_output(vm);
+    free(vm->output.data);
+    vm->output.data = size > 0 ? malloc(size) : NULL;
+    vm->output.size = vm->output.data != NULL ? size : 0;
+    vm->output.capacity = vm->output.size;
+    vm->output.used = 0;
+}
+
+void suspend_virtual_machine(VirtualMachine* vm, uint8_t reason);
+
+// Makes room for length more bytes on a non-blocking stream. If the buffer
+// can't grow, the VM parks with STOP_OUTPUT_FULL before anything is written
+// and what is already buffered stays there.
+void grow_output(VirtualMachine* vm, size_t length) {
+    OutputBuffer* output = &(vm->output);
+    if (!output->nonblocking || length <= output->capacity - output->used) {
+        return;
+    }
+    size_t capacity = output->used + length > 2 * output->capacity ? output->used + length : 2 * output->capacity;
+    char* data = realloc(output->data, capacity);
+    if (data != NULL) {
+        output->data = data;
+        output->capacity = capacity;
+        return;
+    }
+    flush_output(vm);
+    if (length > output->capacity - output->used && vm->exit_point != NULL) {
+        suspend_virtual_machine(vm, STOP_OUTPUT_FULL);
+    }
+}
+
+void write_output(VirtualMachine* vm, const char* text, size_t length) {
+    OutputBuffer* output = &(vm->output);
+    if (length > output->size - output->used || output->used > output->size) {
+        flush_output(vm);
+    }
+    if (output->nonblocking) {
+        grow_output(vm, length);
+        // Outside vm_run() a VM can't park, and nothing there writes output
+        if (length > output->capacity - output->used) {
+            return;
+        }
+    } else if (length > output->capacity - output->used) {
+        flush_output(vm);
+        if (length > output->capacity) {
+            fwrite(text, 1, length, output->stream);
+            return;
+        }
+    }
+    memcpy(output->data + output->used, text, length);
+    output->used += length;
+}
+
+
+void write_output_char(VirtualMachine* vm, char c) {
+    OutputBuffer* output = &(vm->output);
+    if (output->used < output->size) {
+        output->data[output->used++] = c;
+    } else {
+        write_output(vm, &c, 1);
+    }
+}
+
+// Both return the number of characters written
+int write_output_decimal(VirtualMachine* vm, int value) {
+    char digits[12];
+    int start = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+    do {
+        digits[--start] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        digits[--start] = '-';
+    }
+    write_output(vm, digits + start, sizeof(digits) - start);
+    return sizeof(digits) - start;
+}
+
+int write_output_hex(VirtualMachine* vm, unsigned int value) {
+    char digits[8];
+    int start = sizeof(digits);
+    do {
+        digits[--start] = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value > 0);
+    write_output(vm, digits + start, sizeof(digits) - start);
+    return sizeof(digits) - start;
+}
+
+// Ends the run with STOP_HALTED (exit status 0) or STOP_ERROR (1). Inside
+// resume_virtual_machine() this unwinds back to it, otherwise the process
+// exits.
+void stop_virtual_machine(VirtualMachine* vm, uint8_t reason) {
+    int status = reason == STOP_HALTED ? 0 : 1;
+    lock_harts(vm);
+    flush_output(vm->first_hart);
+    release_harts(vm);
+    if (vm->exit_point != NULL) {
+        vm->stop_reason = reason;
+        vm->exit_status = status;
+        longjmp(*(vm->exit_point), 1);
+    }
+    exit(status);
+}
+
+// Hands control back to the host in the middle of an instruction, which
+// runs again from the start when the VM is resumed
+void suspend_virtual_machine(VirtualMachine* vm, uint8_t reason) {
+    release_harts(vm);
+    vm->stop_reason = reason;
+    longjmp(*(vm->exit_point), 1);
+}
+
+// Parks a VM whose non-blocking output is a full buffer behind. Called by
+// the output routines before they write, so they run whole on resume.
+void reserve_output(VirtualMachine* vm) {
+    OutputBuffer* output = &(vm->output);
+    if (output->nonblocking && output->used >= output->size && output->size > 0 && vm->exit_point != NULL) {
+        flush_output(vm);
+        if (output->used >= output->size) {
+            suspend_virtual_machine(vm, STOP_OUTPUT_FULL);
+        }
+    }
+}
+
+// Error handling
+// Errors and dumps go to the first hart's console with the registers of the
+// hart they are about
+void register_dump(VirtualMachine* vm) {
+    VirtualMachine* console = vm->first_hart;
+    char line[32];
+    // Parks before the first line if the rest might not fit, so that no
+    // line is written twice when the instruction runs again
+    grow_output(console, DUMP_OUTPUT_MAX);
+    lock_harts(vm);
+    write_output(console, line, snprintf(line, sizeof(line), "PC = 0x%08x;\n", vm->program_counter));
+    for (int i = 0; i < 32; i++) {
+        write_output(console, line, snprintf(line, sizeof(line), "R[%d] = 0x%08x;\n", i, (unsigned int) vm->registers[i]));
+    }
+    flush_output(console);
+    unlock_harts(vm);
+}
+
+void fake_instruction(VirtualMachine* vm, int num) {
+    char line[48];
+    grow_output(vm->first_hart, sizeof(line) + DUMP_OUTPUT_MAX);
+    lock_harts(vm);
+    write_output(vm->first_hart, line, snprintf(line, sizeof(line), "Instruction Not Implemented: 0x%08x\n", (unsigned int) num));
+    register_dump(vm);
+    unlock_harts(vm);
+}
+
+void illegal_operation(VirtualMachine* vm) {
+    char line[48];
+    grow_output(vm->first_hart, sizeof(line) + DUMP_OUTPUT_MAX);
+    lock_harts(vm);
+    write_output(vm->first_hart, line, snprintf(line, sizeof(line), "Illegal Operation: 0x%08x\n",
+        get_instruction_word(vm, vm->program_counter)));
+    register_dump(vm);
+    stop_virtual_machine(vm, STOP_ERROR);
+}
+
+// Console input
+//
+// The read routines scan straight out of a block of input. A regular file,
+// whether given with --input or redirected to stdin, is mapped whole and
+// anything else is read a block at a time as it arrives. A NULL stream is
+// empty input.
+void open_input(VirtualMachine* vm, FILE* stream) {
+    InputReader* input = &(vm->input);
+    input->stream = stream;
+    input->data = NULL;
+    input->length = 0;
+    input->position = 0;
+    input->mark = 0;
+    input->mapped = 0;
+    input->at_end = 0;
+    input->fifo = 0;
+#if defined(INPUT_MMAP)
+    struct stat info;
+    int fd = stream != NULL ? fileno(stream) : -1;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode)) {
+        input->fifo = 1;
+    } else if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+            input->data = data;
+            input->length = info.st_size;
+            input->position = offset > 0 ? offset : 0;
+            input->origin = -(int64_t) input->position;
+            input->mapped = 1;
+        }
+    }
+#endif
+}
+
+void close_input(VirtualMachine* vm) {
+    InputReader* input = &(vm->input);
+#if defined(INPUT_MMAP)
+    if (input->mapped) {
+        munmap((void*) input->data, input->length);
+    }
+#endif
+    free(input->buffer);
+    memset(input, 0, sizeof(*input));
+}
+
+// Next input byte without consuming it, or -1 at the end of input
+int peek_input(VirtualMachine* vm) {
+    InputReader* input = &(vm->input);
+    if (input->position < input->length) {
+        return input->data[input->position];
+    }
+    if (input->mapped || input->at_end || input->stream == NULL) {
+        return -1;
+    }
+
+    // Keep what the current routine has scanned so far, it starts over if
+    // the VM gets parked
+    size_t kept = input->length - input->mark;
+    if (input->buffer != NULL) {
+        memmove(input->buffer, input->buffer + input->mark, kept);
+    }
+    input->position -= input->mark;
+    input->origin += input->mark;
+    input->length = kept;
+    input->mark = 0;
+    if (input->length == input->capacity) {
+        size_t capacity = input->capacity > 0 ? input->capacity * 2 : INPUT_BUFFER_SIZE;
+        uint8_t* buffer = realloc(input->buffer, capacity);
+        if (buffer == NULL) {
+            input->at_end = 1;
+            return -1;
+        }
+        input->buffer = buffer;
+        input->capacity = capacity;
+    }
+    input->data = input->buffer;
+
+#if defined(INPUT_MMAP)
+    ssize_t count;
+    do {
+        count = read(fileno(input->stream), input->buffer + input->length, input->capacity - input->length);
+    } while (count < 0 && errno == EINTR);
+    if (input->nonblocking && vm->exit_point != NULL) {
+        // A FIFO that hasn't had a writer yet reads as empty without POLLHUP
+        struct pollfd writer = {fileno(input->stream), POLLIN, 0};
+        int no_writer = count == 0 && input->fifo && poll(&writer, 1, 0) >= 0 && !(writer.revents & POLLHUP);
+        if ((count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) || no_writer) {
+            input->position = input->mark;
+            suspend_virtual_machine(vm, STOP_NEEDS_INPUT);
+        }
+    }
+#else
+    char* line = (char*) input->buffer + input->length;
+    long count = fgets(line, input->capacity - input->length, input->stream) != NULL ? (long) strlen(line) : 0;
+#endif
+    if (count <= 0) {
+        input->at_end = 1;
+        return -1;
+    }
+    input->length += count;
+    return input->data[input->position];
+}
+
+int is_input_space(int c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+void skip_input_space(VirtualMachine* vm) {
+    while (is_input_space(peek_input(vm))) {
+        vm->input.position++;
+    }
+}
+
+// Any single character, then any whitespace after it, as scanf("%c\n")
+int read_input_char(VirtualMachine* vm, char* c) {
+    int next = peek_input(vm);
+    if (next < 0) {
+        return 0;
+    }
+    vm->input.position++;
+    *c = (char) next;
+    skip_input_space(vm);
+    return 1;
+}
+
+// An optionally signed decimal integer after any whitespace, as scanf("%d").
+// Like glibc, the value saturates at 64 bits and is then truncated to int.
+int read_input_int(VirtualMachine* vm, int* num) {
+    skip_input_space(vm);
+    int next = peek_input(vm);
+    int negative = 0;
+    if (next == '-' || next == '+') {
+        negative = next == '-';
+        vm->input.position++;
+        next = peek_input(vm);
+    }
+    if (next < '0' || next > '9') {
+        return 0;
+    }
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    uint64_t value = 0;
+    while (next >= '0' && next <= '9') {
+        unsigned int digit = next - '0';
+        value = value > (limit - digit) / 10 ? limit : value * 10 + digit;
+        vm->input.position++;
+        next = peek_input(vm);
+    }
+    *num = (int) (uint32_t) (negative ? 0 - value : value);
+    return 1;
+}
+
+// Heap banks
+int count_trailing_zeros(uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int count = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Shifts a 128-bit bank mask towards bank 0
+void shift_banks_right(uint64_t* banks, int count) {
+    if (count >= 64) {
+        banks[0] = banks[1] >> (count - 64);
+        banks[1] = 0;
+    } else {
+        banks[0] = (banks[0] >> count) | (banks[1] << (64 - count));
+        banks[1] >>= count;
+    }
+}
+
+// Marks banks first .. first + count - 1 as free or in use
+void set_banks_free(HeapMemory* heap, int first, int count, int is_free) {
+    for (int word = 0; word < 2; word++) {
+        int low = first > word * 64 ? first : word * 64;
+        int high = first + count < word * 64 + 64 ? first + count : word * 64 + 64;
+        if (low >= high) {
+            continue;
+        }
+        uint64_t mask = high - low == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << (high - low)) - 1);
+        mask <<= low - word * 64;
+        if (is_free) {
+            heap->free_banks[word] |= mask;
+        } else {
+            heap->free_banks[word] &= ~mask;
+        }
+    }
+}
+
+// First fit: ANDing the free mask with itself shifted leaves bit i set only
+// where banks i .. i + banks_required - 1 are all free, and the doubling
+// shifts need log2(banks_required) steps
+void my_malloc(VirtualMachine* vm, unsigned int size) {
+    HeapMemory* heap = &(vm->first_hart->heap);
+    if (size == 0 || size > 128 * 64) {
+        vm->registers[28] = 0;
+        return;
+    }
+    int banks_required = (size + 63) / 64;
+
+    uint64_t runs[2] = {heap->free_banks[0], heap->free_banks[1]};
+    for (int length = 1; length < banks_required; ) {
+        int step = length < banks_required - length ? length : banks_required - length;
+        uint64_t shifted[2] = {runs[0], runs[1]};
+        shift_banks_right(shifted, step);
+        runs[0] &= shifted[0];
+        runs[1] &= shifted[1];
+        length += step;
+    }
+
+    int first_bank;
+    if (runs[0] != 0) {
+        first_bank = count_trailing_zeros(runs[0]);
+    } else if (runs[1] != 0) {
+        first_bank = 64 + count_trailing_zeros(runs[1]);
+    } else {
+        vm->registers[28] = 0;
+        return;
+    }
+
+    set_banks_free(heap, first_bank, banks_required, 0);
+    heap->banks_used[first_bank] = banks_required;
+    for (int i = first_bank; i < first_bank + banks_required; i++) {
+        heap->first_bank[i] = first_bank;
+    }
+    memset(heap->data + first_bank * 64, 0, banks_required * 64);
+    vm->registers[28] = first_bank * 64 + 0xb700;
+}
+
+int is_bank_free(HeapMemory* heap, int bank_index) {
+    return (heap->free_banks[bank_index / 64] >> (bank_index % 64)) & 1;
+}
+
+void error_check_heap_bank(VirtualMachine* vm, int address) {
+	if (address < 0xb700 || address >= 0xb700 + 128 * 64) {
+        illegal_operation(vm);
+	}
+
+    if (address % 64 != 0) { // not start of bank
+        illegal_operation(vm);
+    }
+
+	if (is_bank_free(&(vm->first_hart->heap), (address - 0xb700) / 64)) {
+		illegal_operation(vm); // not allocated
+	}
+}
+
+// Only the start of an allocation can be freed, and all of its banks are
+// released together
+void my_free(VirtualMachine* vm, int address) {
+	error_check_heap_bank(vm, address);
+
+    HeapMemory* heap = &(vm->first_hart->heap);
+    int bank_index = (address - 0xb700) / 64;
+    if (heap->first_bank[bank_index] != bank_index) {
+        illegal_operation(vm);
+    }
+    set_banks_free(heap, bank_index, heap->banks_used[bank_index], 1);
+}
+
+// Virtual routines
+// Console routines use the first hart's streams. Only the first hart halting
+// prints the halt message, the others just end.
+// Input read since start, an earlier origin + position
+void count_input(VirtualMachine* vm, int64_t start) {
+    if (vm->stats != NULL) {
+        vm->stats->input_bytes += vm->input.origin + (int64_t) vm->input.position - start;
+    }
+}
+
+int check_virtual_routine(VirtualMachine* vm, int vr_id, uint8_t register_index) {
+    VirtualMachine* console = vm->first_hart;
+    // Only what the program prints counts as console output, not the VM's
+    // own messages
+    int written = 0;
+    if (vr_id <= 2 || vr_id == 6 || vr_id == 8) {
+        reserve_output(vm);
+    }
+	if (vr_id == 0) {
+        write_output_char(console, (char) vm->registers[register_index]);
+        written = 1;
+    } else if (vr_id == 1) {
+        written = write_output_decimal(console, (int) vm->registers[register_index]);
+    } else if (vr_id == 2) {
+        written = write_output_hex(console, vm->registers[register_index]);
+    } else if (vr_id == 3) {
+        if (vm == console) {
+            write_output(console, "CPU Halt Requested\n", 19);
+        }
+        stop_virtual_machine(vm, STOP_HALTED);
+    } else if (vr_id == 4) {
+        flush_output(console);
+        console->input.mark = console->input.position;
+        int64_t start = console->input.origin + (int64_t) console->input.position;
+        char c;
+		if (read_input_char(console, &c)) {
+			vm->registers[register_index] = (unsigned int) c;
+		}        
+        count_input(console, start);
+    } else if (vr_id == 5) {
+        flush_output(console);
+        console->input.mark = console->input.position;
+        int64_t start = console->input.origin + (int64_t) console->input.position;
+        int num;
+		if (read_input_int(console, &num)) {
+			vm->registers[register_index] = (unsigned int) num;
+		}        
+        count_input(console, start);
+    } else if (vr_id == 6) {
+        written = write_output_hex(console, vm->program_counter);
+    } else if (vr_id == 7) {
+        register_dump(vm);
+    } else if (vr_id == 8) {
+        written = write_output_hex(console, vm->registers[register_index]);
+    }
+    if (console->stats != NULL) {
+        console->stats->output_bytes += written;
+    }
+	return 0;
+}
+
+// Memory map
+//
+// Every access is routed by the kind of the 256-byte page it starts in.
+// Instruction and data memory are one little-endian byte array, so plain
+// loads and stores are a bounds check and a memcpy.
+void init_page_table(VirtualMachine* vm) {
+    for (int i = 0; i < 256; i++) {
+        if (i < 0x04) {
+            vm->page_table[i] = PAGE_INSTRUCTION;
+        } else if (i < 0x08) {
+            vm->page_table[i] = PAGE_DATA;
+        } else if (i == 0x08) {
+            vm->page_table[i] = PAGE_VIRTUAL_ROUTINE;
+        } else if (i >= 0xb7 && i < 0xd7) {
+            vm->page_table[i] = PAGE_HEAP;
+        } else {
+            vm->page_table[i] = PAGE_UNMAPPED;
+        }
+    }
+}
+
+uint8_t get_page_kind(VirtualMachine* vm, unsigned int address, int size) {
+    if (address > 0xFFFF) {
+        return PAGE_UNMAPPED;
+    }
+    uint8_t kind = vm->page_table[address >> 8];
+    // Plain memory accesses may not run past the end of data memory
+    if (kind <= PAGE_DATA && address + size > 0x800) {
+        return PAGE_UNMAPPED;
+    }
+    return kind;
+}
+
+// Records that data memory from address to address + length - 1 was written
+void mark_dirty(VirtualMachine* vm, unsigned int address, unsigned int length) {
+    if (length == 0) {
+        return;
+    }
+    unsigned int first = address / 4;
+    unsigned int last = (address + length - 1) / 4;
+    uint8_t* dirty_words = vm->first_hart->dirty_words;
+    dirty_words[first] = 1;
+    if (last > first) {
+        memset(dirty_words + first + 1, 1, last - first);
+    }
+}
+
+// Host pointer to length bytes of guest memory starting at address, or NULL
+// unless the whole range is data memory, allocated heap banks or, when only
+// reading, instruction memory
+uint8_t* get_guest_range(VirtualMachine* vm, unsigned int address, unsigned int length, int writable) {
+    unsigned int lowest = writable ? 0x400 : 0;
+    if (address >= lowest && address < 0x800 && length <= 0x800 - address) {
+        if (writable) {
+            mark_dirty(vm, address, length);
+        }
+        return vm->first_hart->memory + address;
+    }
+
+    HeapMemory* heap = &(vm->first_hart->heap);
+    unsigned int offset = address - 0xb700;
+    if (address < 0xb700 || offset >= sizeof(heap->data) || length > sizeof(heap->data) - offset) {
+        return NULL;
+    }
+    unsigned int last = length == 0 ? offset : offset + length - 1;
+    for (unsigned int bank = offset / 64; bank <= last / 64; bank++) {
+        if (is_bank_free(heap, bank)) {
+            return NULL;
+        }
+    }
+    return heap->data + offset;
+}
+
+// Bulk memory routines, run natively on guest memory with the arguments in
+// a0, a1 and a2 as for the C library functions. Overlapping copies are
+// allowed and memcmp returns -1, 0 or 1 in R[28].
+void guest_memcpy(VirtualMachine* vm) {
+    unsigned int length = vm->registers[12];
+    uint8_t* destination = get_guest_range(vm, vm->registers[10], length, 1);
+    uint8_t* source = get_guest_range(vm, vm->registers[11], length, 0);
+    if (destination == NULL || source == NULL) {
+        illegal_operation(vm);
+    }
+    memmove(destination, source, length);
+}
+
+void guest_memset(VirtualMachine* vm) {
+    unsigned int length = vm->registers[12];
+    uint8_t* destination = get_guest_range(vm, vm->registers[10], length, 1);
+    if (destination == NULL) {
+        illegal_operation(vm);
+    }
+    memset(destination, (uint8_t) vm->registers[11], length);
+}
+
+void guest_memcmp(VirtualMachine* vm) {
+    unsigned int length = vm->registers[12];
+    uint8_t* first = get_guest_range(vm, vm->registers[10], length, 0);
+    uint8_t* second = get_guest_range(vm, vm->registers[11], length, 0);
+    if (first == NULL || second == NULL) {
+        illegal_operation(vm);
+    }
+    int result = memcmp(first, second, length);
+    vm->registers[28] = result < 0 ? (unsigned int) -1 : result > 0;
+}
+
+// Profiling
+//
+// While a profile is attached every instruction dispatches through the
+// profiler first, see execute_instructions(), which counts it by program
+// counter. A branch is counted as taken when the next instruction isn't the
+// one after it. Virtual routine accesses are timed in cycles by routine.
+//
+// The call graph is a tree of call paths. jal or jalr writing ra is a call,
+// jalr ra with rd = x0 a return, and every instruction counts towards the
+// path it ran in.
+struct call_node {
+    uint16_t function; // entry address / 4
+    uint16_t depth;
+    int parent;
+    int first_child;
+    int next_sibling;
+    uint64_t calls;
+    uint64_t instructions; // run in this function on this path
+};
+typedef struct call_node CallNode;
+
+struct profile {
+    uint64_t counts[257]; // by address / 4, with the guard entry
+    uint64_t taken[257];
+    int branch; // index of the branch whose outcome is still to be seen, or -1
+    uint64_t routine_calls[64]; // by (address - 0x800) / 4
+    uint64_t routine_cycles[64];
+
+    // Call graph, nodes[0] is the entry point. Calls past the deepest path
+    // or the last node stay where they are, overflow being how many of them
+    // are yet to return.
+    uint8_t call_graph;
+    CallNode* nodes;
+    int node_count;
+    int node_capacity;
+    int current_node; // -1 until the first instruction after a reset
+    int overflow;
+    uint64_t untracked_calls; // all of those calls so far
+    char* symbols[256]; // function names by entry address / 4
+};
+typedef struct profile Profile;
+
+// Execution trace
+//
+// The last entries instructions run, in a ring that is only written out on
+// request. An entry's rd value is filled in when the next one is recorded.
+// A trace file is a header and then its entries, oldest first.
+#define TRACE_VERSION 1
+
+struct trace_entry {
+    uint32_t program_counter;
+    uint32_t instruction; // as in instruction memory
+    uint32_t rd_value; // rd after the instruction, 0 without one
+    uint32_t address; // accessed by a load, store or atomic, 0 otherwise
+};
+typedef struct trace_entry TraceEntry;
+
+struct trace {
+    TraceEntry* entries;
+    uint64_t mask; // entries - 1, a power of two
+    uint64_t count; // recorded so far, the ring keeps the last of them
+    uint8_t pending_rd; // of the newest entry, 0 if there is nothing to fill in
+};
+typedef struct trace Trace;
+
+struct trace_header {
+    char magic[4]; // "MIT\0"
+    uint32_t version;
+    uint64_t count; // entries in the file
+    uint64_t dropped; // older ones the ring had no room for
+};
+typedef struct trace_header TraceHeader;
+
+uint64_t read_cycles(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    return __rdtsc();
+#elif defined(__unix__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+void profile_routine(VirtualMachine* vm, unsigned int address, uint64_t start) {
+    unsigned int routine = ((address - 2048) / 4) % 64;
+    vm->profile->routine_calls[routine]++;
+    vm->profile->routine_cycles[routine] += read_cycles() - start;
+}
+
+// Heap allocations for the run statistics, after my_malloc() has returned
+// the address in R[28]
+void count_allocation(VirtualMachine* vm) {
+    RunStats* stats = vm->stats;
+    if (vm->registers[28] == 0) {
+        stats->failed_allocations++;
+        return;
+    }
+    stats->allocations++;
+    int banks = 0;
+    for (int bank = 0; bank < 128; bank++) {
+        banks += !is_bank_free(&(vm->first_hart->heap), bank);
+    }
+    if (banks > stats->heap_banks) {
+        stats->heap_banks = banks;
+    }
+}
+
+// Virtual routine accesses, as for load_memory() and store_memory()
+int load_routine(VirtualMachine* vm, unsigned int address, int size, uint8_t rd, unsigned int* value) {
+    lock_harts(vm);
+    if (vm->routine_handler != NULL && vm->routine_handler(vm, vm->routine_context, (address - 2048) / 4, 0, value)) {
+        unlock_harts(vm);
+        if (size < 4) {
+            *value &= (1u << (size * 8)) - 1;
+        }
+        return 1;
+    }
+    check_virtual_routine(vm, (address - 2048) / 4, rd);
+    unlock_harts(vm);
+    return 0;
+}
+
+void store_routine(VirtualMachine* vm, unsigned int address, unsigned int value, uint8_t rs2) {
+    // 0x830 malloc, 0x834 free, 0x838 memcpy, 0x83c memset, 0x840 memcmp,
+    // 0x844 start hart
+    lock_harts(vm);
+    if (vm->routine_handler != NULL && vm->routine_handler(vm, vm->routine_context, (address - 2048) / 4, 1, &value)) {
+        unlock_harts(vm);
+        return;
+    } else if (address == 2096) {
+        my_malloc(vm, value);
+        if (vm->stats != NULL) {
+            count_allocation(vm);
+        }
+    } else if (address == 2100) {
+        my_free(vm, value);
+        if (vm->stats != NULL) {
+            vm->stats->frees++;
+        }
+    } else if (address == 2104) {
+        guest_memcpy(vm);
+    } else if (address == 2108) {
+        guest_memset(vm);
+    } else if (address == 2112) {
+        guest_memcmp(vm);
+    } else if (address == 2116) {
+        start_hart(vm, value);
+    } else {
+        check_virtual_routine(vm, (address - 2048) / 4, rs2);
+    }
+    unlock_harts(vm);
+}
+
+// Reads size bytes into *value. Returns 0 if the address was a virtual
+// routine, which writes rd itself.
+int load_memory(VirtualMachine* vm, unsigned int address, int size, uint8_t rd, unsigned int* value) {
+    uint8_t kind = get_page_kind(vm, address, size);
+    if (vm->stats != NULL) {
+        vm->stats->loads[kind]++;
+    }
+
+    if (kind == PAGE_INSTRUCTION || kind == PAGE_DATA) {
+        *value = 0;
+        memcpy(value, vm->first_hart->memory + address, size);
+        return 1;
+    } else if (kind == PAGE_VIRTUAL_ROUTINE) {
+        // lw has always read the routines from 0x816 up two bytes lower
+        if (size == 4 && address >= 2070) {
+            address -= 2;
+        }
+        if (vm->profile != NULL) {
+            uint64_t start = read_cycles();
+            int loaded = load_routine(vm, address, size, rd, value);
+            profile_routine(vm, address, start);
+            return loaded;
+        }
+        return load_routine(vm, address, size, rd, value);
+    } else if (kind == PAGE_HEAP) {
+        uint8_t* bytes = get_guest_range(vm, address, size, 0);
+        if (bytes != NULL) {
+            *value = 0;
+            memcpy(value, bytes, size);
+            return 1;
+        }
+    }
+    illegal_operation(vm);
+    return 0;
+}
+
+void store_memory(VirtualMachine* vm, unsigned int address, int size, uint8_t rs2) {
+    uint8_t kind = get_page_kind(vm, address, size);
+    unsigned int value = vm->registers[rs2];
+    if (vm->stats != NULL) {
+        vm->stats->stores[kind]++;
+    }
+
+    if (size < 4) {
+        value &= (1u << (size * 8)) - 1;
+    }
+
+    if (kind == PAGE_DATA) {
+        memcpy(vm->first_hart->memory + address, &value, size);
+        mark_dirty(vm, address, size);
+    } else if (kind == PAGE_VIRTUAL_ROUTINE) {
+        if (vm->profile != NULL) {
+            uint64_t start = read_cycles();
+            store_routine(vm, address, value, rs2);
+            profile_routine(vm, address, start);
+        } else {
+            store_routine(vm, address, value, rs2);
+        }
+    } else if (kind == PAGE_HEAP) {
+        uint8_t* bytes = get_guest_range(vm, address, size, 1);
+        if (bytes == NULL) {
+            illegal_operation(vm);
+        }
+        memcpy(bytes, &value, size);
+    } else {
+        illegal_operation(vm);
+    }
+}
+
+// Arithmetic and logic operations
+void add(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] + vm->registers[rs2];
+    }    
+}
+
+void addi(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] + imm;
+    }
+}
+
+void sub(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] - vm->registers[rs2];
+    }
+}
+
+void lui(VirtualMachine* vm, uint8_t rd, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = (unsigned int) imm << 12;
+    }
+}
+
+void xor(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] ^ vm->registers[rs2];
+    }
+}
+
+void xori(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] ^ imm;
+    }
+}
+
+void or(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] | vm->registers[rs2];
+    }
+}
+
+void ori(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] | imm;
+    }
+}
+
+void and(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] & vm->registers[rs2];
+    }
+}
+
+void andi(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->registers[rs1] & imm;
+    }
+}
+
+void sll(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+	//printf("sll (%d) ", vm->program_counter); 
+    if (rd != 0) {
+        vm->registers[rd] =  vm->registers[rs1] << vm->registers[rs2];
+    }
+}
+
+void srl(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] =  vm->registers[rs1] >> vm->registers[rs2];
+    }
+}
+
+void sra(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    int value = vm->registers[rs1];
+    for (int i = 0; i < vm->registers[rs2]; i++) {
+        if ((value & 0b01) > 0) {
+            value = value >> 1;
+            value = value | 0b10000000;
+        } else {
+            value = value >> 1;
+        }
+    }
+    if (rd != 0) {
+        vm->registers[rd] = value;
+    }
+}
+
+// Memory operations
+void lb(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int value;
+    if (load_memory(vm, vm->registers[rs1] + imm, 1, rd, &value) && rd != 0) {
+        vm->registers[rd] = (unsigned int) (int8_t) value;
+    }
+}
+
+void lh(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int value;
+    if (load_memory(vm, vm->registers[rs1] + imm, 2, rd, &value) && rd != 0) {
+        vm->registers[rd] = (unsigned int) (int16_t) value;
+    }
+}
+
+void lw(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int value;
+    if (load_memory(vm, vm->registers[rs1] + imm, 4, rd, &value) && rd != 0) {
+        vm->registers[rd] = value;
+    }
+}
+
+void lbu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int value;
+    if (load_memory(vm, vm->registers[rs1] + imm, 1, rd, &value) && rd != 0) {
+        vm->registers[rd] = value;
+    }
+}
+
+void lhu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int value;
+    if (load_memory(vm, vm->registers[rs1] + imm, 2, rd, &value) && rd != 0) {
+        vm->registers[rd] = value;
+    }
+}
+
+void sb(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
+    store_memory(vm, vm->registers[rs1] + imm, 1, rs2);
+}
+
+void sh(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
+    store_memory(vm, vm->registers[rs1] + imm, 2, rs2);
+}
+
+void sw(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
+    store_memory(vm, vm->registers[rs1] + imm, 4, rs2);
+}
+
+// Atomic memory operations on aligned words of data memory or allocated heap
+// banks. lr.w reserves the word along with the value it read, and sc.w
+// stores only while the word still holds that value, writing 0 to rd if it
+// did and 1 if not.
+void atomic_memory_operation(VirtualMachine* vm, uint8_t handler, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    unsigned int address = vm->registers[rs1];
+    uint32_t* word = address % 4 == 0 ? (uint32_t*) get_guest_range(vm, address, 4, handler != HANDLER_LR) : NULL;
+    if (word == NULL || address < 0x400) {
+        illegal_operation(vm);
+    }
+    if (vm->stats != NULL) {
+        uint8_t kind = get_page_kind(vm, address, 4);
+        vm->stats->loads[kind] += handler != HANDLER_SC;
+        vm->stats->stores[kind] += handler != HANDLER_LR;
+    }
+    uint32_t value = vm->registers[rs2];
+    uint32_t result;
+#if defined(__GNUC__)
+    if (handler == HANDLER_AMOADD) {
+        result = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+    } else if (handler == HANDLER_AMOSWAP) {
+        result = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+    } else if (handler == HANDLER_LR) {
+        result = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+    } else {
+        uint32_t expected = vm->reserved_value;
+        result = !(vm->reservation == address
+            && __atomic_compare_exchange_n(word, &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    }
+#else
+    result = handler == HANDLER_SC ? !(vm->reservation == address && *word == vm->reserved_value) : *word;
+    if (handler == HANDLER_AMOADD) {
+        *word += value;
+    } else if (handler == HANDLER_AMOSWAP || (handler == HANDLER_SC && result == 0)) {
+        *word = value;
+    }
+#endif
+    vm->reservation = handler == HANDLER_LR ? address : 1;
+    vm->reserved_value = result;
+    if (rd != 0) {
+        vm->registers[rd] = result;
+    }
+}
+
+void fence(void) {
+#if defined(__GNUC__)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+// Program flow operations
+void slt(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    if (rd != 0) {
+        vm->registers[rd] = (vm->registers[rs1] < vm->registers[rs2]) ? 1 : 0;
+    }
+}
+
+void slti(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = (vm->registers[rs1] < imm) ? 1 : 0;
+    }
+}
+
+void sltu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
+    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
+    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
+    if (rd != 0) {
+        vm->registers[rd] = (rs1_value < rs2_value) ? 1 : 0;
+    }
+}
+
+void sltiu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
+    unsigned int imm_value = (unsigned int) imm;
+    if (rd != 0) {
+        vm->registers[rd] = (rs1_value < imm_value) ? 1 : 0;
+    }
+}
+
+void beq(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    if (vm->registers[rs1] == vm->registers[rs2]) {
+        vm->program_counter = vm->program_counter + imm;
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void bne(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    if (vm->registers[rs1] != vm->registers[rs2]) {
+        vm->program_counter = vm->program_counter + imm;
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void blt(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    if (vm->registers[rs1] < vm->registers[rs2]) {
+        vm->program_counter = vm->program_counter + imm;		
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void bltu(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
+    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
+    unsigned int imm_value = (unsigned int) imm;
+    if (rs1_value < rs2_value) {
+        vm->program_counter = vm->program_counter + imm_value;
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void bge(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    if (vm->registers[rs1] >= vm->registers[rs2]) {
+        vm->program_counter = vm->program_counter + imm;
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void bgeu(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
+    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
+    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
+    unsigned int imm_value = (unsigned int) imm;
+    if (rs1_value >= rs2_value) {
+        vm->program_counter = vm->program_counter + imm_value;
+        return;
+    }
+    vm->program_counter += 4;
+}
+
+void jal(VirtualMachine* vm, uint8_t rd, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->program_counter + 4;
+    }
+    vm->program_counter = vm->program_counter + imm;
+}
+
+void jalr(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
+    if (rd != 0) {
+        vm->registers[rd] = vm->program_counter + 4;
+    }
+    vm->program_counter = vm->registers[rs1] + imm;
+}
+
+// Instruction fields
+uint8_t get_rd(unsigned int num) {
+    return (num >> 7) & 0x1F;
+}
+
+uint8_t get_func3(unsigned int num) {
+    return (num >> 12) & 0x7;
+}
+
+uint8_t get_rs1(unsigned int num) {
+    return (num >> 15) & 0x1F;
+}
+
+uint8_t get_rs2(unsigned int num) {
+    return (num >> 20) & 0x1F;
+}
+
+uint8_t get_func7(unsigned int num) {
+    return (num >> 25) & 0x7F;
+}
+
+// Immediates are sign-extended from the top bit of the instruction
+int get_imm_I(unsigned int num) {
+    return (int) num >> 20;
+}
+
+int get_imm_S(unsigned int num) {
+    return ((int) (num & 0xFE000000) >> 20) | ((num >> 7) & 0x1F);
+}
+
+int get_imm_SB(unsigned int num) {
+    return ((int) (num & 0x80000000) >> 19) | ((num & 0x80) << 4) | ((num >> 20) & 0x7E0) | ((num >> 7) & 0x1E);
+}
+
+int get_imm_U(unsigned int num) {
+    return (int) num >> 12;
+}
+
+int get_imm_UJ(unsigned int num) {
+    return ((int) (num & 0x80000000) >> 11) | (num & 0xFF000) | ((num >> 9) & 0x800) | ((num >> 20) & 0x7FE);
+}
+
+// Format types and decode instructions
+void decode_R(DecodedInstruction* decoded, unsigned int num) {
+    uint8_t func3 = get_func3(num);
+    uint8_t func7 = get_func7(num);
+
+    decoded->rd = get_rd(num);
+    decoded->rs1 = get_rs1(num);
+    decoded->rs2 = get_rs2(num);
+
+    // Logic and arithmetic
+    if (func3 == 0b000 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_ADD;
+    } else if (func3 == 0b000 && func7 == 0b0100000) {
+        decoded->handler = HANDLER_SUB;
+    } else if (func3 == 0b100 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_XOR;
+    } else if (func3 == 0b110 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_OR;
+    } else if (func3 == 0b111 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_AND;
+    } else if (func3 == 0b001 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_SLL;
+    } else if (func3 == 0b101 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_SRL;
+    } else if (func3 == 0b101 && func7 == 0b0100000) {
+        decoded->handler = HANDLER_SRA;
+    // Program flow
+    } else if (func3 == 0b010 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_SLT;
+    } else if (func3 == 0b011 && func7 == 0b0000000) {
+        decoded->handler = HANDLER_SLTU;
+    }
+}
+
+void decode_I(DecodedInstruction* decoded, unsigned int num, uint8_t opcode) {
+    uint8_t func3 = get_func3(num);
+
+    decoded->rd = get_rd(num);
+    decoded->rs1 = get_rs1(num);
+    decoded->imm = get_imm_I(num);
+
+    // Logic and arithmetic
+    if (opcode == 0b0010011) {
+        if (func3 == 0b000) {
+            decoded->handler = HANDLER_ADDI;
+        } else if (func3 == 0b100) {
+            decoded->handler = HANDLER_XORI;
+        } else if (func3 == 0b110) {
+            decoded->handler = HANDLER_ORI;
+        } else if (func3 == 0b111) {
+            decoded->handler = HANDLER_ANDI;
+        // Program flow
+        } else if (func3 == 0b010) {
+            decoded->handler = HANDLER_SLTI;
+        } else if (func3 == 0b011) {
+            decoded->handler = HANDLER_SLTIU;
+        }
+    // Memory
+    } else if (opcode == 0b0000011) {
+        if (func3 == 0b000) {
+            decoded->handler = HANDLER_LB;
+        } else if (func3 == 0b001) {
+            decoded->handler = HANDLER_LH;
+        } else if (func3 == 0b010) {
+            decoded->handler = HANDLER_LW;
+        } else if (func3 == 0b100) {
+            decoded->handler = HANDLER_LBU;
+        } else if (func3 == 0b101) {
+            decoded->handler = HANDLER_LHU;
+        }
+    // Program flow
+    } else if (opcode == 0b1100111) {
+        if (func3 == 0b000) {
+            decoded->handler = HANDLER_JALR;
+        }
+    }
+}
+
+void decode_S(DecodedInstruction* decoded, unsigned int num) {
+    uint8_t func3 = get_func3(num);
+
+    decoded->rs1 = get_rs1(num);
+    decoded->rs2 = get_rs2(num);
+    decoded->imm = get_imm_S(num);
+
+    if (func3 == 0b000) {
+        decoded->handler = HANDLER_SB;
+    } else if (func3 == 0b001) {
+        decoded->handler = HANDLER_SH;
+    } else if (func3 == 0b010) {
+        decoded->handler = HANDLER_SW;
+    }
+}
+
+void decode_SB(DecodedInstruction* decoded, unsigned int num) {
+    uint8_t func3 = get_func3(num);
+
+    decoded->rs1 = get_rs1(num);
+    decoded->rs2 = get_rs2(num);
+    decoded->imm = get_imm_SB(num);
+
+    if (func3 == 0b000) {
+        decoded->handler = HANDLER_BEQ;
+    } else if (func3 == 0b001) {
+        decoded->handler = HANDLER_BNE;
+    } else if (func3 == 0b100) {
+        decoded->handler = HANDLER_BLT;
+    } else if (func3 == 0b110) {
+        decoded->handler = HANDLER_BLTU;
+    } else if (func3 == 0b101) {
+        decoded->handler = HANDLER_BGE;
+    } else if (func3 == 0b111) {
+        decoded->handler = HANDLER_BGEU;
+    }
+}
+
+// RV32A word operations, funct5 in the top bits. The ordering bits are
+// ignored, every operation is sequentially consistent.
+void decode_AMO(DecodedInstruction* decoded, unsigned int num) {
+    static const uint8_t handlers[] = {HANDLER_AMOADD, HANDLER_AMOSWAP, HANDLER_LR, HANDLER_SC};
+    uint8_t func5 = get_func7(num) >> 2;
+
+    decoded->rd = get_rd(num);
+    decoded->rs1 = get_rs1(num);
+    decoded->rs2 = get_rs2(num);
+
+    if (get_func3(num) == 0b010 && func5 < 4) {
+        decoded->handler = handlers[func5];
+    }
+}
+
+// Encodings with no matching handler stay HANDLER_NOT_IMPLEMENTED
+void decode_instruction(DecodedInstruction* decoded, unsigned int num) {
+    uint8_t opcode = num & 0x7F;
+
+    decoded->handler = HANDLER_NOT_IMPLEMENTED;
+    decoded->rd = 0;
+    decoded->rs1 = 0;
+    decoded->rs2 = 0;
+    decoded->imm = 0;
+
+    switch (opcode) {
+        case 0b0110011:
+            decode_R(decoded, num);
+            break;
+        case 0b0010011:
+        case 0b0000011:
+        case 0b1100111:
+            decode_I(decoded, num, opcode);
+            break;
+        case 0b0100011:
+            decode_S(decoded, num);
+            break;
+        case 0b1100011:
+            decode_SB(decoded, num);
+            break;
+        case 0b0110111:
+            decoded->handler = HANDLER_LUI;
+            decoded->rd = get_rd(num);
+            decoded->imm = get_imm_U(num);
+            break;
+        case 0b1101111:
+            decoded->handler = HANDLER_JAL;
+            decoded->rd = get_rd(num);
+            decoded->imm = get_imm_UJ(num);
+            break;
+        case 0b0101111:
+            decode_AMO(decoded, num);
+            break;
+        case 0b0001111:
+            if (get_func3(num) == 0b000) {
+                decoded->handler = HANDLER_FENCE;
+            }
+            break;
+    }
+}
+
+void predecode_instructions(VirtualMachine* vm) {
+    for (int i = 0; i < 256; i++) {
+        decode_instruction(&(vm->decoded_instructions[i]), get_instruction_word(vm, i * 4));
+    }
+    vm->decoded_instructions[256].handler = HANDLER_END_OF_MEMORY;
+}
+
+// Basic blocks
+int is_block_terminator(uint8_t handler) {
+    return (handler >= HANDLER_BEQ && handler <= HANDLER_JALR) || handler == HANDLER_NOT_IMPLEMENTED;
+}
+
+void mark_block_leader(uint8_t* leaders, unsigned int address) {
+    if (address <= 1020 && address % 4 == 0) {
+        leaders[address / 4] = 1;
+    }
+}
+
+// A block starts at address 0, at every branch or jal target and after every
+// control transfer (return addresses of jal/jalr), and runs up to and
+// including its first control transfer
+void find_basic_blocks(VirtualMachine* vm) {
+    uint8_t leaders[256] = {1};
+
+    for (int i = 0; i < 256; i++) {
+        DecodedInstruction* instruction = &(vm->decoded_instructions[i]);
+        if (!is_block_terminator(instruction->handler)) {
+            continue;
+        }
+        mark_block_leader(leaders, (i + 1) * 4);
+        if (instruction->handler != HANDLER_JALR && instruction->handler != HANDLER_NOT_IMPLEMENTED) {
+            mark_block_leader(leaders, i * 4 + instruction->imm);
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        vm->basic_blocks[i].length = 0;
+        if (leaders[i] == 0) {
+            continue;
+        }
+        int end = i;
+        while (!is_block_terminator(vm->decoded_instructions[end].handler) && end < 255 && leaders[end + 1] == 0) {
+            end++;
+        }
+        vm->basic_blocks[i].length = end - i + 1;
+    }
+}
+
+// Superinstructions
+//
+// A fused handler runs the instruction it replaces and then the one after it,
+// whose decoded entry is left untouched so jumps straight to it still work.
+uint8_t get_superinstruction(DecodedInstruction* first, DecodedInstruction* second) {
+    if (first->handler == HANDLER_LUI && first->rd != 0) {
+        if (second->handler == HANDLER_ADDI && second->rd == first->rd && second->rs1 == first->rd) {
+            return HANDLER_LUI_ADDI;
+        } else if (second->handler == HANDLER_LW && second->rs1 == first->rd) {
+            return HANDLER_LUI_LW;
+        } else if (second->handler == HANDLER_SW && second->rs1 == first->rd) {
+            return HANDLER_LUI_SW;
+        }
+    } else if (first->handler == HANDLER_SLT && second->rs1 == first->rd && second->rs2 == 0) {
+        if (second->handler == HANDLER_BNE) {
+            return HANDLER_SLT_BNE;
+        } else if (second->handler == HANDLER_BEQ) {
+            return HANDLER_SLT_BEQ;
+        }
+    } else if (first->handler == HANDLER_SLTU && second->rs1 == first->rd && second->rs2 == 0) {
+        if (second->handler == HANDLER_BNE) {
+            return HANDLER_SLTU_BNE;
+        } else if (second->handler == HANDLER_BEQ) {
+            return HANDLER_SLTU_BEQ;
+        }
+    } else if (first->handler == HANDLER_ADDI && first->rd != 0
+            && (second->rs1 == first->rd || second->rs2 == first->rd)) {
+        if (second->handler == HANDLER_BNE) {
+            return HANDLER_ADDI_BNE;
+        } else if (second->handler == HANDLER_BLT) {
+            return HANDLER_ADDI_BLT;
+        }
+    }
+    return first->handler;
+}
+
+// The plain handler a superinstruction starts with
+uint8_t get_first_handler(uint8_t handler) {
+    switch (handler) {
+        case HANDLER_LUI_ADDI:
+        case HANDLER_LUI_LW:
+        case HANDLER_LUI_SW:
+            return HANDLER_LUI;
+        case HANDLER_SLT_BNE:
+        case HANDLER_SLT_BEQ:
+            return HANDLER_SLT;
+        case HANDLER_SLTU_BNE:
+        case HANDLER_SLTU_BEQ:
+            return HANDLER_SLTU;
+        case HANDLER_ADDI_BNE:
+        case HANDLER_ADDI_BLT:
+            return HANDLER_ADDI;
+    }
+    return handler;
+}
+
+void fuse_instructions(VirtualMachine* vm) {
+    for (int start = 0; start < 256; start++) {
+        int end = start + vm->basic_blocks[start].length - 1;
+        for (int i = start; i < end; i++) {
+            DecodedInstruction* instruction = &(vm->decoded_instructions[i]);
+            uint8_t handler = get_superinstruction(instruction, instruction + 1);
+            if (handler != instruction->handler) {
+                instruction->handler = handler;
+                i++;
+            }
+        }
+    }
+}
+
+// x86-64 JIT for hot basic blocks
+//
+// The interpreter counts entries into each basic block and compiles a block
+// once it has been entered JIT_HOT_THRESHOLD times. Compiled code keeps the
+// block's most used guest registers in callee-saved host registers, loops
+// natively when the block branches back to itself and otherwise writes the
+// registers back, stores the next program counter and returns. Loads and
+// stores outside instruction and data memory (virtual routines, heap) leave
+// the block so the interpreter executes them.
+#if defined(JIT_SUPPORTED)
+
+#define JIT_CODE_SIZE (128 * 1024)
+#define JIT_MAX_BLOCK_CODE(length) (256 + (length) * 192)
+#define JIT_CACHED_REGISTERS 5
+
+// Host register numbers
+#define HOST_EAX 0
+#define HOST_ECX 1
+#define HOST_EBX 3
+#define HOST_EBP 5
+#define HOST_R12 12
+#define HOST_R13 13
+#define HOST_R14 14
+#define HOST_R15 15
+
+// Condition codes for setcc/jcc
+#define CONDITION_B 0x2
+#define CONDITION_AE 0x3
+#define CONDITION_E 0x4
+#define CONDITION_NE 0x5
+#define CONDITION_A 0x7
+#define CONDITION_LE 0xE
+#define CONDITION_G 0xF
+
+#define OFFSET_PROGRAM_COUNTER ((int) offsetof(VirtualMachine, program_counter))
+#define OFFSET_REGISTER(index) ((int) (offsetof(VirtualMachine, registers) + 4 * (index)))
+
+struct block_compiler {
+    uint8_t* code;
+    size_t used;
+    uint8_t host_registers[32]; // host register caching each guest register, 0 if none
+    uint32_t written_registers; // cached guest registers the block writes
+};
+typedef struct block_compiler BlockCompiler;
+
+static const uint8_t cache_host_registers[JIT_CACHED_REGISTERS] = {HOST_EBX, HOST_R12, HOST_R13, HOST_R14, HOST_R15};
+
+void emit8(BlockCompiler* compiler, uint8_t byte) {
+    compiler->code[compiler->used++] = byte;
+}
+
+void emit32(BlockCompiler* compiler, uint32_t value) {
+    memcpy(compiler->code + compiler->used, &value, 4);
+    compiler->used += 4;
+}
+
+// REX prefix for a ModRM reg/rm pair when either is r8-r15
+void emit_rex(BlockCompiler* compiler, uint8_t reg, uint8_t rm) {
+    uint8_t rex = 0x40 | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) {
+        emit8(compiler, rex);
+    }
+}
+
+// op r/m32, r32 for mov (0x89), add (0x01), sub (0x29), xor (0x31), or (0x09), and (0x21), cmp (0x39)
+void emit_reg_reg(BlockCompiler* compiler, uint8_t opcode, uint8_t dst, uint8_t src) {
+    emit_rex(compiler, src, dst);
+    emit8(compiler, opcode);
+    emit8(compiler, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// op r32, imm32 where digit selects add (0), or (1), and (4), sub (5), xor (6), cmp (7)
+void emit_reg_imm(BlockCompiler* compiler, uint8_t digit, uint8_t dst, int imm) {
+    emit_rex(compiler, 0, dst);
+    emit8(compiler, 0x81);
+    emit8(compiler, 0xC0 | (digit << 3) | (dst & 7));
+    emit32(compiler, (uint32_t) imm);
+}
+
+void emit_mov_imm(BlockCompiler* compiler, uint8_t dst, uint32_t imm) {
+    emit_rex(compiler, 0, dst);
+    emit8(compiler, 0xB8 + (dst & 7));
+    emit32(compiler, imm);
+}
+
+// mov r32, [rbp + offset] (0x8B) or mov [rbp + offset], r32 (0x89)
+void emit_vm_access(BlockCompiler* compiler, uint8_t opcode, uint8_t reg, int offset) {
+    emit_rex(compiler, reg, HOST_EBP);
+    emit8(compiler, opcode);
+    emit8(compiler, 0x80 | ((reg & 7) << 3) | HOST_EBP);
+    emit32(compiler, (uint32_t) offset);
+}
+
+// shl (4), shr (5) r32 by cl
+void emit_shift(BlockCompiler* compiler, uint8_t digit, uint8_t dst) {
+    emit_rex(compiler, 0, dst);
+    emit8(compiler, 0xD3);
+    emit8(compiler, 0xC0 | (digit << 3) | (dst & 7));
+}
+
+// setcc al; movzx eax, al
+void emit_set_condition(BlockCompiler* compiler, uint8_t condition) {
+    emit8(compiler, 0x0F);
+    emit8(compiler, 0x90 | condition);
+    emit8(compiler, 0xC0);
+    emit8(compiler, 0x0F);
+    emit8(compiler, 0xB6);
+    emit8(compiler, 0xC0);
+}
+
+// Conditional or unconditional jump, returns where the rel32 to patch starts
+size_t emit_jump(BlockCompiler* compiler, int condition) {
+    if (condition < 0) {
+        emit8(compiler, 0xE9);
+    } else {
+        emit8(compiler, 0x0F);
+        emit8(compiler, 0x80 | condition);
+    }
+    emit32(compiler, 0);
+    return compiler->used - 4;
+}
+
+void patch_jump(BlockCompiler* compiler, size_t at, size_t target) {
+    int32_t rel = (int32_t) (target - (at + 4));
+    memcpy(compiler->code + at, &rel, 4);
+}
+
+void emit_load_guest(BlockCompiler* compiler, uint8_t host, uint8_t guest) {
+    if (guest == 0) {
+        emit_reg_reg(compiler, 0x31, host, host);
+    } else if (compiler->host_registers[guest] != 0) {
+        emit_reg_reg(compiler, 0x89, host, compiler->host_registers[guest]);
+    } else {
+        emit_vm_access(compiler, 0x8B, host, OFFSET_REGISTER(guest));
+    }
+}
+
+void emit_store_guest(BlockCompiler* compiler, uint8_t guest, uint8_t host) {
+    if (guest == 0) {
+        return;
+    } else if (compiler->host_registers[guest] != 0) {
+        emit_reg_reg(compiler, 0x89, compiler->host_registers[guest], host);
+    } else {
+        emit_vm_access(compiler, 0x89, host, OFFSET_REGISTER(guest));
+    }
+}
+
+void emit_write_back(BlockCompiler* compiler) {
+    for (int i = 1; i < 32; i++) {
+        if (compiler->written_registers & (1u << i)) {
+            emit_vm_access(compiler, 0x89, compiler->host_registers[i], OFFSET_REGISTER(i));
+        }
+    }
+}
+
+void emit_epilogue(BlockCompiler* compiler) {
+    static const uint8_t epilogue[] = {
+        0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, // pop r15, r14, r13, r12
+        0x5D, 0x5B, 0xC3 // pop rbp, rbx; ret
+    };
+    memcpy(compiler->code + compiler->used, epilogue, sizeof(epilogue));
+    compiler->used += sizeof(epilogue);
+}
+
+// Leave the block continuing at a known address
+void emit_exit(BlockCompiler* compiler, unsigned int program_counter) {
+    emit_write_back(compiler);
+    emit8(compiler, 0xC7); // mov dword [rbp + offset], imm32
+    emit8(compiler, 0x85);
+    emit32(compiler, (uint32_t) OFFSET_PROGRAM_COUNTER);
+    emit32(compiler, program_counter);
+    emit_epilogue(compiler);
+}
+
+// shr reg, 2; mov byte [rbp + reg + dirty_words], 1 for the address in reg
+void emit_mark_dirty(BlockCompiler* compiler, uint8_t reg) {
+    emit8(compiler, 0xC1);
+    emit8(compiler, 0xE8 | reg);
+    emit8(compiler, 2);
+    emit8(compiler, 0xC6);
+    emit8(compiler, 0x84);
+    emit8(compiler, (reg << 3) | HOST_EBP);
+    emit32(compiler, (uint32_t) offsetof(VirtualMachine, dirty_words));
+    emit8(compiler, 1);
+}
+
+// Plain memory is accessed in place through [rbp + rax + offset]. Virtual
+// routines, the heap and illegal addresses leave the block at the
+// instruction so the interpreter routes them through the page table.
+void emit_memory_access(BlockCompiler* compiler, DecodedInstruction* instruction, uint8_t handler, unsigned int program_counter) {
+    int is_store = handler >= HANDLER_SB;
+    int size = 4;
+    if (handler == HANDLER_LB || handler == HANDLER_LBU || handler == HANDLER_SB) {
+        size = 1;
+    } else if (handler == HANDLER_LH || handler == HANDLER_LHU || handler == HANDLER_SH) {
+        size = 2;
+    }
+
+    emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+    emit_reg_imm(compiler, 0, HOST_EAX, instruction->imm);
+    emit_reg_imm(compiler, 7, HOST_EAX, 0x800 - size);
+    size_t outside = emit_jump(compiler, CONDITION_A);
+    size_t read_only = 0;
+    if (is_store) {
+        emit_reg_imm(compiler, 7, HOST_EAX, 0x400);
+        read_only = emit_jump(compiler, CONDITION_B);
+        emit_load_guest(compiler, HOST_ECX, instruction->rs2);
+        if (size == 2) {
+            emit8(compiler, 0x66);
+        }
+        emit8(compiler, size == 1 ? 0x88 : 0x89);
+    } else if (instruction->rd != 0) {
+        switch (handler) {
+            case HANDLER_LB: emit8(compiler, 0x0F); emit8(compiler, 0xBE); break; // movsx
+            case HANDLER_LBU: emit8(compiler, 0x0F); emit8(compiler, 0xB6); break; // movzx
+            case HANDLER_LH: emit8(compiler, 0x0F); emit8(compiler, 0xBF); break;
+            case HANDLER_LHU: emit8(compiler, 0x0F); emit8(compiler, 0xB7); break;
+            default: emit8(compiler, 0x8B); break;
+        }
+    }
+    if (is_store || instruction->rd != 0) {
+        emit8(compiler, 0x8C); // ecx, [rbp + rax + offset]
+        emit8(compiler, 0x05);
+        emit32(compiler, (uint32_t) offsetof(VirtualMachine, memory));
+    }
+    if (is_store) {
+        // The words holding the first and last byte written are dirty
+        emit_reg_reg(compiler, 0x89, HOST_ECX, HOST_EAX);
+        emit_mark_dirty(compiler, HOST_ECX);
+        if (size > 1) {
+            emit_reg_imm(compiler, 0, HOST_EAX, size - 1);
+            emit_mark_dirty(compiler, HOST_EAX);
+        }
+    } else {
+        emit_store_guest(compiler, instruction->rd, HOST_ECX);
+    }
+
+    size_t done = emit_jump(compiler, -1);
+    patch_jump(compiler, outside, compiler->used);
+    if (is_store) {
+        patch_jump(compiler, read_only, compiler->used);
+    }
+    emit_exit(compiler, program_counter);
+    patch_jump(compiler, done, compiler->used);
+}
+
+// Returns 0 if the instruction can't be compiled and the block has to stop before it
+int emit_instruction(BlockCompiler* compiler, DecodedInstruction* instruction, uint8_t handler, unsigned int program_counter) {
+    uint8_t rd = instruction->rd;
+    uint8_t alu_opcode = 0;
+    uint8_t alu_digit = 0;
+
+    switch (handler) {
+        case HANDLER_ADD: alu_opcode = 0x01; break;
+        case HANDLER_SUB: alu_opcode = 0x29; break;
+        case HANDLER_XOR: alu_opcode = 0x31; break;
+        case HANDLER_OR: alu_opcode = 0x09; break;
+        case HANDLER_AND: alu_opcode = 0x21; break;
+        case HANDLER_ADDI: alu_digit = 0; break;
+        case HANDLER_ORI: alu_digit = 1; break;
+        case HANDLER_ANDI: alu_digit = 4; break;
+        case HANDLER_XORI: alu_digit = 6; break;
+    }
+
+    switch (handler) {
+        case HANDLER_ADD:
+        case HANDLER_SUB:
+        case HANDLER_XOR:
+        case HANDLER_OR:
+        case HANDLER_AND:
+            if (rd != 0) {
+                emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+                emit_load_guest(compiler, HOST_ECX, instruction->rs2);
+                emit_reg_reg(compiler, alu_opcode, HOST_EAX, HOST_ECX);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        case HANDLER_SLL:
+        case HANDLER_SRL:
+            if (rd != 0) {
+                emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+                emit_load_guest(compiler, HOST_ECX, instruction->rs2);
+                emit_shift(compiler, handler == HANDLER_SLL ? 4 : 5, HOST_EAX);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        // Registers are unsigned, so slt compares like sltu
+        case HANDLER_SLT:
+        case HANDLER_SLTU:
+            if (rd != 0) {
+                emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+                emit_load_guest(compiler, HOST_ECX, instruction->rs2);
+                emit_reg_reg(compiler, 0x39, HOST_EAX, HOST_ECX);
+                emit_set_condition(compiler, CONDITION_B);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        case HANDLER_ADDI:
+        case HANDLER_XORI:
+        case HANDLER_ORI:
+        case HANDLER_ANDI:
+            if (rd != 0) {
+                emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+                emit_reg_imm(compiler, alu_digit, HOST_EAX, instruction->imm);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        case HANDLER_SLTI:
+        case HANDLER_SLTIU:
+            if (rd != 0) {
+                emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+                emit_reg_imm(compiler, 7, HOST_EAX, instruction->imm);
+                emit_set_condition(compiler, CONDITION_B);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        case HANDLER_LUI:
+            if (rd != 0) {
+                emit_mov_imm(compiler, HOST_EAX, (unsigned int) instruction->imm << 12);
+                emit_store_guest(compiler, rd, HOST_EAX);
+            }
+            return 1;
+        case HANDLER_LB:
+        case HANDLER_LH:
+        case HANDLER_LW:
+        case HANDLER_LBU:
+        case HANDLER_LHU:
+        case HANDLER_SB:
+        case HANDLER_SH:
+        case HANDLER_SW:
+            emit_memory_access(compiler, instruction, handler, program_counter);
+            return 1;
+    }
+    return 0;
+}
+
+// Ends the block with its control transfer, looping natively when it
+// targets the start of the block
+void emit_terminator(BlockCompiler* compiler, DecodedInstruction* instruction, uint8_t handler,
+        unsigned int program_counter, unsigned int block_start, size_t body) {
+    unsigned int target = program_counter + instruction->imm;
+    int condition = -1;
+
+    switch (handler) {
+        case HANDLER_BEQ: condition = CONDITION_E; break;
+        case HANDLER_BNE: condition = CONDITION_NE; break;
+        case HANDLER_BLT:
+        case HANDLER_BLTU: condition = CONDITION_B; break;
+        case HANDLER_BGE:
+        case HANDLER_BGEU: condition = CONDITION_AE; break;
+    }
+
+    if (handler == HANDLER_JALR) {
+        if (instruction->rd != 0) {
+            emit_mov_imm(compiler, HOST_EAX, program_counter + 4);
+            emit_store_guest(compiler, instruction->rd, HOST_EAX);
+        }
+        emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+        emit_reg_imm(compiler, 0, HOST_EAX, instruction->imm);
+        emit_write_back(compiler);
+        emit_vm_access(compiler, 0x89, HOST_EAX, OFFSET_PROGRAM_COUNTER);
+        emit_epilogue(compiler);
+        return;
+    }
+
+    if (handler == HANDLER_JAL) {
+        if (instruction->rd != 0) {
+            emit_mov_imm(compiler, HOST_EAX, program_counter + 4);
+            emit_store_guest(compiler, instruction->rd, HOST_EAX);
+        }
+    } else {
+        emit_load_guest(compiler, HOST_EAX, instruction->rs1);
+        emit_load_guest(compiler, HOST_ECX, instruction->rs2);
+        emit_reg_reg(compiler, 0x39, HOST_EAX, HOST_ECX);
+    }
+
+    size_t taken = emit_jump(compiler, condition);
+    if (condition >= 0) {
+        emit_exit(compiler, program_counter + 4);
+    }
+    patch_jump(compiler, taken, compiler->used);
+    if (target == block_start) {
+        // Every iteration is charged to the quantum, and the loop leaves to
+        // the interpreter once it runs out or another hart asks it to stop
+        emit8(compiler, 0x48); // sub qword [rbp + offset], imm32
+        emit8(compiler, 0x81);
+        emit8(compiler, 0xAD);
+        emit32(compiler, (uint32_t) offsetof(VirtualMachine, instruction_budget));
+        emit32(compiler, (program_counter - block_start) / 4 + 1);
+        size_t expired = emit_jump(compiler, CONDITION_LE);
+        emit8(compiler, 0x83); // cmp dword [rbp + offset], 0
+        emit8(compiler, 0xBD);
+        emit32(compiler, (uint32_t) offsetof(VirtualMachine, stop_requested));
+        emit8(compiler, 0);
+        size_t loop = emit_jump(compiler, CONDITION_E);
+        patch_jump(compiler, loop, body);
+        patch_jump(compiler, expired, compiler->used);
+    }
+    emit_exit(compiler, target);
+}
+
+// Caches the most referenced guest registers of the block in host registers
+void allocate_host_registers(BlockCompiler* compiler, DecodedInstruction* instructions, int length) {
+    int uses[32] = {0};
+
+    for (int i = 0; i < length; i++) {
+        DecodedInstruction* instruction = &(instructions[i]);
+        uses[instruction->rd]++;
+        uses[instruction->rs1]++;
+        uses[instruction->rs2]++;
+    }
+    uses[0] = 0;
+
+    for (int i = 0; i < JIT_CACHED_REGISTERS; i++) {
+        int best = 0;
+        for (int j = 1; j < 32; j++) {
+            if (compiler->host_registers[j] == 0 && uses[j] > uses[best]) {
+                best = j;
+            }
+        }
+        if (uses[best] < 2) {
+            break;
+        }
+        compiler->host_registers[best] = cache_host_registers[i];
+    }
+}
+
+int compile_block(VirtualMachine* vm, int start) {
+    BasicBlock* block = &(vm->basic_blocks[start]);
+    int length = block->length;
+
+    if (vm->jit_code == NULL) {
+        void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            vm->jit_enabled = 0;
+            return 0;
+        }
+        vm->jit_code = code;
+    }
+    if (vm->jit_code_used + JIT_MAX_BLOCK_CODE(length) > JIT_CODE_SIZE) {
+        block->jit_failed = 1;
+        return 0;
+    }
+
+    BlockCompiler compiler = {vm->jit_code + vm->jit_code_used, 0, {0}, 0};
+    DecodedInstruction* instructions = &(vm->decoded_instructions[start]);
+    allocate_host_registers(&compiler, instructions, length);
+
+    // Only instructions up to the first one that can't be compiled run natively
+    int compiled = 0;
+    while (compiled < length) {
+        uint8_t handler = get_first_handler(instructions[compiled].handler);
+        if (!is_block_terminator(handler) && handler != HANDLER_SRA
+                && (handler < HANDLER_AMOADD || handler > HANDLER_FENCE)
+                && handler != HANDLER_NOT_IMPLEMENTED && handler != HANDLER_BREAKPOINT
+                && handler != HANDLER_END_OF_MEMORY) {
+            compiled++;
+        } else {
+            break;
+        }
+    }
+    int has_terminator = compiled < length && is_block_terminator(instructions[compiled].handler)
+        && instructions[compiled].handler != HANDLER_NOT_IMPLEMENTED;
+    if (compiled == 0 && !has_terminator) {
+        block->jit_failed = 1;
+        return 0;
+    }
+
+    // Stores and branches decode with rd = 0
+    for (int i = 0; i < (compiled + has_terminator); i++) {
+        uint8_t rd = instructions[i].rd;
+        if (rd != 0 && compiler.host_registers[rd] != 0) {
+            compiler.written_registers |= 1u << rd;
+        }
+    }
+
+    if (mprotect(vm->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        vm->jit_enabled = 0;
+        return 0;
+    }
+
+    static const uint8_t prologue[] = {
+        0x53, 0x55, // push rbx, rbp
+        0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push r12, r13, r14, r15
+        0x48, 0x83, 0xEC, 0x08, // sub rsp, 8
+        0x48, 0x89, 0xFD // mov rbp, rdi
+    };
+    memcpy(compiler.code, prologue, sizeof(prologue));
+    compiler.used = sizeof(prologue);
+    for (int i = 1; i < 32; i++) {
+        if (compiler.host_registers[i] != 0) {
+            emit_vm_access(&compiler, 0x8B, compiler.host_registers[i], OFFSET_REGISTER(i));
+        }
+    }
+
+    // Every pass through the body counts as a native run of the block
+    size_t body = compiler.used;
+    emit8(&compiler, 0x83); // add dword [rbp + offset], 1
+    emit8(&compiler, 0x85);
+    emit32(&compiler, (uint32_t) ((uint8_t*) &(block->native_runs) - (uint8_t*) vm));
+    emit8(&compiler, 0x01);
+
+    unsigned int block_start = start * 4;
+    for (int i = 0; i < compiled; i++) {
+        uint8_t handler = get_first_handler(instructions[i].handler);
+        emit_instruction(&compiler, &(instructions[i]), handler, block_start + i * 4);
+    }
+    if (has_terminator) {
+        emit_terminator(&compiler, &(instructions[compiled]), instructions[compiled].handler,
+            block_start + compiled * 4, block_start, body);
+    } else {
+        emit_exit(&compiler, block_start + compiled * 4);
+    }
+
+    if (mprotect(vm->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        vm->jit_enabled = 0;
+        return 0;
+    }
+    block->native_code = (NativeBlock) (void*) compiler.code;
+    block->native_size = compiler.used;
+    vm->jit_code_used += compiler.used;
+    return 1;
+}
+
+#else
+
+int compile_block(VirtualMachine* vm, int start) {
+    vm->jit_enabled = 0;
+    return 0;
+}
+
+#endif
+
+// Whether another thread has asked the quantum to end early. Acquire, so
+// that translated code re-reads guest memory after each check.
+int is_stop_requested(VirtualMachine* vm) {
+#if defined(MULTI_HART)
+    return __atomic_load_n(&(vm->stop_requested), __ATOMIC_ACQUIRE);
+#else
+    (void) vm;
+    return 0;
+#endif
+}
+
+// Runs compiled blocks for as long as execution stays on them
+void run_native_blocks(VirtualMachine* vm) {
+    while (vm->program_counter <= 1020 && vm->program_counter % 4 == 0 && vm->instruction_budget > 0 &&
+           !is_stop_requested(vm)) {
+        BasicBlock* block = &(vm->basic_blocks[vm->program_counter / 4]);
+        if (block->length == 0) {
+            return;
+        }
+        block->entry_count++;
+        if (block->native_code == NULL) {
+            if (block->entry_count < JIT_HOT_THRESHOLD || block->jit_failed || !compile_block(vm, vm->program_counter / 4)) {
+                return;
+            }
+        }
+        unsigned int block_start = vm->program_counter;
+        vm->instruction_budget -= block->length;
+        block->native_code(vm);
+        if (vm->program_counter == block_start) {
+            // Left before its first instruction, which the interpreter has
+            // to run, or at the end of a loop. Refunding the entry charge
+            // lets a quantum shorter than the block still run the former.
+            vm->instruction_budget += block->length;
+            return;
+        }
+    }
+}
+
+// Block-level statistics printed after the run with --jit-stats
+void print_jit_stats(VirtualMachine* vm) {
+    int blocks = 0;
+    int compiled = 0;
+
+    for (int i = 0; i < 256; i++) {
+        BasicBlock* block = &(vm->basic_blocks[i]);
+        if (block->length == 0 || block->entry_count == 0) {
+            continue;
+        }
+        blocks++;
+        if (block->native_code != NULL) {
+            compiled++;
+            fprintf(stderr, "block 0x%03x: %2d instructions, %10u entries, %10u native runs, %4zu bytes\n",
+                i * 4, block->length, block->entry_count, block->native_runs, block->native_size);
+        } else {
+            fprintf(stderr, "block 0x%03x: %2d instructions, %10u entries, interpreted\n",
+                i * 4, block->length, block->entry_count);
+        }
+    }
+    fprintf(stderr, "JIT %s: %d blocks entered, %d compiled, %zu bytes of native code\n",
+        vm->jit_enabled ? "enabled" : "disabled", blocks, compiled, vm->jit_code_used);
+}
+
+// Moves to the callee's node on a call, adding it to the tree the first time
+void enter_function(Profile* profile, unsigned int address) {
+    CallNode* current = &(profile->nodes[profile->current_node]);
+    uint16_t function = address <= 1020 ? address / 4 : 256;
+    if (profile->overflow > 0 || current->depth >= CALL_GRAPH_MAX_DEPTH) {
+        profile->overflow++;
+        profile->untracked_calls++;
+        return;
+    }
+    int child = current->first_child;
+    while (child >= 0 && profile->nodes[child].function != function) {
+        child = profile->nodes[child].next_sibling;
+    }
+    if (child < 0) {
+        if (profile->node_count == profile->node_capacity) {
+            int capacity = profile->node_capacity * 2;
+            CallNode* nodes = capacity <= CALL_GRAPH_MAX_NODES ? realloc(profile->nodes, capacity * sizeof(CallNode)) : NULL;
+            if (nodes == NULL) {
+                profile->overflow++;
+                profile->untracked_calls++;
+                return;
+            }
+            profile->nodes = nodes;
+            profile->node_capacity = capacity;
+            current = &(profile->nodes[profile->current_node]);
+        }
+        child = profile->node_count++;
+        CallNode* node = &(profile->nodes[child]);
+        node->function = function;
+        node->depth = current->depth + 1;
+        node->parent = profile->current_node;
+        node->first_child = -1;
+        node->next_sibling = current->first_child;
+        node->calls = 0;
+        node->instructions = 0;
+        current->first_child = child;
+    }
+    profile->nodes[child].calls++;
+    profile->current_node = child;
+}
+
+void leave_function(Profile* profile) {
+    if (profile->overflow > 0) {
+        profile->overflow--;
+    } else if (profile->current_node > 0) {
+        profile->current_node = profile->nodes[profile->current_node].parent;
+    }
+}
+
+// Counts the instruction about to run towards the current call path, then
+// follows it if it is a call or a return
+void track_calls(VirtualMachine* vm, DecodedInstruction* instruction, int count) {
+    Profile* profile = vm->profile;
+    if (profile->current_node < 0) { // first instruction since a reset
+        profile->current_node = 0;
+        profile->nodes[0].calls++;
+    }
+    profile->nodes[profile->current_node].instructions += count;
+    if (instruction->handler == HANDLER_JAL && instruction->rd == 1) {
+        enter_function(profile, vm->program_counter + instruction->imm);
+    } else if (instruction->handler == HANDLER_JALR && instruction->rd == 1) {
+        enter_function(profile, vm->registers[instruction->rs1] + instruction->imm);
+    } else if (instruction->handler == HANDLER_JALR && instruction->rd == 0 && instruction->rs1 == 1) {
+        leave_function(profile);
+    }
+}
+
+// Counts the instruction about to run, both of a fused pair, and the
+// outcome of the branch before it
+void profile_instruction(VirtualMachine* vm, DecodedInstruction* instruction) {
+    Profile* profile = vm->profile;
+    unsigned int index = vm->program_counter / 4;
+    uint8_t handler = instruction->handler;
+
+    if (profile->branch >= 0) {
+        profile->taken[profile->branch] += vm->program_counter != (unsigned int) profile->branch * 4 + 4;
+        profile->branch = -1;
+    }
+    if (handler == HANDLER_BREAKPOINT) {
+        return;
+    }
+    profile->counts[index]++;
+    // Traced runs take fused pairs a half at a time
+    if (handler >= HANDLER_LUI_ADDI && handler <= HANDLER_ADDI_BLT && vm->trace == NULL) {
+        index++;
+        profile->counts[index]++;
+        handler = instruction[1].handler;
+    }
+    if (handler >= HANDLER_BEQ && handler <= HANDLER_BGEU) {
+        profile->branch = index;
+    }
+    if (profile->call_graph) {
+        track_calls(vm, instruction, index - vm->program_counter / 4 + 1);
+    }
+}
+
+int compare_counts_descending(const void* first, const void* second) {
+    uint64_t a = ((const uint64_t*) first)[0];
+    uint64_t b = ((const uint64_t*) second)[0];
+    return a < b ? 1 : a > b ? -1 : 0;
+}
+
+// Hot spots by program counter, then totals by mnemonic, branch outcomes by
+// branch instruction and time in the virtual routines
+void print_profile(VirtualMachine* vm) {
+    static const char* routine_names[64] = {
+        "write char", "write int", "write hex", "halt", "read char", "read int", "write pc",
+        "dump registers", "write word", [12] = "malloc", "free", "memcpy", "memset", "memcmp", "start hart"
+    };
+    Profile* profile = vm->profile;
+    uint64_t rows[257][2]; // count, then address / 4 or handler
+    uint64_t by_handler[HANDLER_PROFILE + 1][3] = {{0}}; // count, taken, handler
+    uint8_t handlers[257];
+    uint64_t total = 0;
+    int count = 0;
+    if (profile == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < 257; i++) {
+        DecodedInstruction decoded;
+        decode_instruction(&decoded, get_instruction_word(vm, i * 4));
+        handlers[i] = i < 256 ? decoded.handler : HANDLER_END_OF_MEMORY;
+        by_handler[handlers[i]][0] += profile->counts[i];
+        by_handler[handlers[i]][1] += profile->taken[i];
+        total += profile->counts[i];
+        if (profile->counts[i] > 0) {
+            rows[count][0] = profile->counts[i];
+            rows[count++][1] = i;
+        }
+    }
+    qsort(rows, count, sizeof(rows[0]), compare_counts_descending);
+    fprintf(stderr, "profile: %llu instructions\n", (unsigned long long) total);
+    fprintf(stderr, "hot spots:\n");
+    for (int i = 0; i < count && i < PROFILE_HOT_SPOTS; i++) {
+        int index = (int) rows[i][1];
+        uint8_t handler = handlers[index];
+        fprintf(stderr, "  0x%03x %-15s %12llu %6.2f%%", index * 4, handler_names[handler],
+            (unsigned long long) rows[i][0], 100.0 * rows[i][0] / total);
+        if (handler >= HANDLER_BEQ && handler <= HANDLER_BGEU) {
+            fprintf(stderr, "  %llu taken, %llu not taken", (unsigned long long) profile->taken[index],
+                (unsigned long long) (rows[i][0] - profile->taken[index]));
+        }
+        fprintf(stderr, "\n");
+    }
+
+    for (int i = 0; i <= HANDLER_PROFILE; i++) {
+        by_handler[i][2] = i;
+    }
+    qsort(by_handler, HANDLER_PROFILE + 1, sizeof(by_handler[0]), compare_counts_descending);
+    fprintf(stderr, "instructions:\n");
+    for (int i = 0; i <= HANDLER_PROFILE && by_handler[i][0] > 0; i++) {
+        fprintf(stderr, "  %-15s %12llu %6.2f%%\n", handler_names[by_handler[i][2]],
+            (unsigned long long) by_handler[i][0], 100.0 * by_handler[i][0] / total);
+    }
+    fprintf(stderr, "branches:\n");
+    for (int i = 0; i <= HANDLER_PROFILE && by_handler[i][0] > 0; i++) {
+        uint64_t handler = by_handler[i][2];
+        if (handler >= HANDLER_BEQ && handler <= HANDLER_BGEU) {
+            fprintf(stderr, "  %-15s %12llu taken %12llu not taken\n", handler_names[handler],
+                (unsigned long long) by_handler[i][1], (unsigned long long) (by_handler[i][0] - by_handler[i][1]));
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < 64; i++) {
+        if (profile->routine_calls[i] > 0) {
+            rows[count][0] = profile->routine_cycles[i];
+            rows[count++][1] = i;
+        }
+    }
+    qsort(rows, count, sizeof(rows[0]), compare_counts_descending);
+    fprintf(stderr, "virtual routines:\n");
+    for (int i = 0; i < count; i++) {
+        int routine = (int) rows[i][1];
+        uint64_t calls = profile->routine_calls[routine];
+        fprintf(stderr, "  0x%03x %-15s %12llu calls %14llu cycles %10.1f per call\n", 0x800 + routine * 4,
+            routine_names[routine] != NULL ? routine_names[routine] : "other", (unsigned long long) calls,
+            (unsigned long long) rows[i][0], (double) rows[i][0] / calls);
+    }
+}
+
+// Starts the call graph at the entry point, at the program counter if there
+// is no symbol there
+int start_call_graph(VirtualMachine* vm) {
+    Profile* profile = vm->profile;
+    if (profile->nodes == NULL) {
+        profile->nodes = malloc(64 * sizeof(CallNode));
+        if (profile->nodes == NULL) {
+            return 0;
+        }
+        profile->node_capacity = 64;
+        profile->node_count = 1;
+        CallNode root = {vm->program_counter <= 1020 ? vm->program_counter / 4 : 0, 0, -1, -1, -1, 1, 0};
+        profile->nodes[0] = root;
+    }
+    profile->call_graph = 1;
+    return 1;
+}
+
+// Back at the entry point for another run, which the root counts as a call
+// once the reset VM runs again
+void restart_call_graph(Profile* profile) {
+    profile->current_node = profile->nodes != NULL ? -1 : 0;
+    profile->overflow = 0;
+    profile->branch = -1;
+}
+
+void free_profile(Profile* profile) {
+    if (profile != NULL) {
+        for (int i = 0; i < 256; i++) {
+            free(profile->symbols[i]);
+        }
+        free(profile->nodes);
+        free(profile);
+    }
+}
+
+// Symbol map lines are an address in hex and a name, or nm output (address,
+// type, name). Blank lines and lines starting with # are skipped.
+int load_symbols(VirtualMachine* vm, const char* path) {
+    FILE* file = fopen(path, "r");
+    char line[512];
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long address;
+        char first[256];
+        char second[256];
+        int fields = sscanf(line, "%lx %255s %255s", &address, first, second);
+        if (line[0] == '#' || fields < 2 || address > 1020 || address % 4 != 0) {
+            continue;
+        }
+        free(vm->profile->symbols[address / 4]);
+        vm->profile->symbols[address / 4] = strdup(fields == 3 ? second : first);
+    }
+    fclose(file);
+    return 1;
+}
+
+const char* get_function_name(Profile* profile, int function, char* buffer, size_t size) {
+    if (function < 256 && profile->symbols[function] != NULL) {
+        return profile->symbols[function];
+    }
+    snprintf(buffer, size, "0x%03x", function * 4);
+    return buffer;
+}
+
+// Every call path with the instructions run at its end, one per line as
+// "entry;caller;callee count", for flame graph tools
+int write_folded_stacks(VirtualMachine* vm, FILE* out) {
+    Profile* profile = vm->profile;
+    int path[CALL_GRAPH_MAX_DEPTH + 1];
+    char name[8];
+    for (int i = 0; profile != NULL && i < profile->node_count; i++) {
+        if (profile->nodes[i].instructions == 0) {
+            continue;
+        }
+        int depth = 0;
+        for (int node = i; node >= 0; node = profile->nodes[node].parent) {
+            path[depth++] = node;
+        }
+        while (depth-- > 0) {
+            fprintf(out, "%s%c", get_function_name(profile, profile->nodes[path[depth]].function, name, sizeof(name)),
+                depth > 0 ? ';' : ' ');
+        }
+        fprintf(out, "%llu\n", (unsigned long long) profile->nodes[i].instructions);
+    }
+    return !ferror(out);
+}
+
+// Inclusive and exclusive instructions by function. Recursive calls count
+// once towards the inclusive total, at the outermost call.
+void print_call_graph(VirtualMachine* vm) {
+    Profile* profile = vm->profile;
+    if (profile == NULL || profile->nodes == NULL) {
+        return;
+    }
+    uint64_t* inclusive = calloc(profile->node_count, sizeof(uint64_t));
+    uint64_t functions[257][4] = {{0}}; // inclusive, exclusive, calls, function
+    char name[8];
+    if (inclusive == NULL) {
+        return;
+    }
+    // Children always come after their parents
+    for (int i = profile->node_count - 1; i >= 0; i--) {
+        CallNode* node = &(profile->nodes[i]);
+        inclusive[i] += node->instructions;
+        if (node->parent >= 0) {
+            inclusive[node->parent] += inclusive[i];
+        }
+    }
+    for (int i = 0; i < profile->node_count; i++) {
+        CallNode* node = &(profile->nodes[i]);
+        int outermost = 1;
+        for (int parent = node->parent; parent >= 0 && outermost; parent = profile->nodes[parent].parent) {
+            outermost = profile->nodes[parent].function != node->function;
+        }
+        functions[node->function][0] += outermost ? inclusive[i] : 0;
+        functions[node->function][1] += node->instructions;
+        functions[node->function][2] += node->calls;
+    }
+    free(inclusive);
+
+    for (int i = 0; i < 257; i++) {
+        functions[i][3] = i;
+    }
+    qsort(functions, 257, sizeof(functions[0]), compare_counts_descending);
+    fprintf(stderr, "functions:\n  %-24s %12s %12s %10s\n", "", "inclusive", "exclusive", "calls");
+    for (int i = 0; i < 257 && functions[i][0] > 0; i++) {
+        fprintf(stderr, "  %-24s %12llu %12llu %10llu\n", get_function_name(profile, (int) functions[i][3], name, sizeof(name)),
+            (unsigned long long) functions[i][0], (unsigned long long) functions[i][1], (unsigned long long) functions[i][2]);
+    }
+    if (profile->untracked_calls > 0) {
+        fprintf(stderr, "  %llu calls past %d paths or %d deep count towards their callers\n",
+            (unsigned long long) profile->untracked_calls, CALL_GRAPH_MAX_NODES, CALL_GRAPH_MAX_DEPTH);
+    }
+}
+
+// Execution trace
+//
+// Records the instruction about to run and returns the handler to run it
+// with. Fused pairs run one half at a time while tracing, so that every
+// instruction gets an entry of its own.
+uint8_t trace_instruction(VirtualMachine* vm, DecodedInstruction* instruction) {
+    Trace* trace = vm->trace;
+    uint8_t handler = get_first_handler(instruction->handler);
+    unsigned int program_counter = vm->program_counter;
+    if (handler == HANDLER_BREAKPOINT) {
+        return handler;
+    }
+    if (trace->pending_rd != 0) {
+        trace->entries[(trace->count - 1) & trace->mask].rd_value = vm->registers[trace->pending_rd];
+    }
+    TraceEntry* entry = &(trace->entries[trace->count++ & trace->mask]);
+    entry->program_counter = program_counter;
+    entry->instruction = 0;
+    if (program_counter <= 1020) {
+        memcpy(&(entry->instruction), vm->memory + program_counter, 4);
+    }
+    entry->rd_value = 0;
+    entry->address = 0;
+    if (handler >= HANDLER_LB && handler <= HANDLER_SW) {
+        entry->address = vm->registers[instruction->rs1] + instruction->imm;
+    } else if (handler >= HANDLER_AMOADD && handler <= HANDLER_SC) {
+        entry->address = vm->registers[instruction->rs1];
+    }
+    trace->pending_rd = instruction->rd;
+    return handler;
+}
+
+void free_trace(Trace* trace) {
+    if (trace != NULL) {
+        free(trace->entries);
+        free(trace);
+    }
+}
+
+// Writes the ring out, oldest entry first. Returns 0 on error.
+int write_trace(VirtualMachine* vm, const char* path) {
+    Trace* trace = vm->trace;
+    if (trace == NULL) {
+        return 0;
+    }
+    if (trace->pending_rd != 0) {
+        trace->entries[(trace->count - 1) & trace->mask].rd_value = vm->registers[trace->pending_rd];
+        trace->pending_rd = 0;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "MIT", 4);
+    header.version = TRACE_VERSION;
+    header.count = trace->count < trace->mask + 1 ? trace->count : trace->mask + 1;
+    header.dropped = trace->count - header.count;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    // The oldest entries are at the end of the ring once it has wrapped
+    size_t start = header.dropped & trace->mask;
+    size_t first = header.count < trace->mask + 1 - start ? header.count : trace->mask + 1 - start;
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    failed |= fwrite(trace->entries + start, sizeof(TraceEntry), first, file) != first;
+    failed |= fwrite(trace->entries, sizeof(TraceEntry), header.count - first, file) != header.count - first;
+    failed |= fclose(file) != 0;
+    if (failed) {
+        fprintf(stderr, "error writing %s\n", path);
+    }
+    return !failed;
+}
+
+// Assembly for an instruction at address, with branch and jump targets as
+// addresses
+void format_instruction(char* text, size_t size, DecodedInstruction* decoded, unsigned int address) {
+    uint8_t handler = decoded->handler;
+    const char* name = handler_names[handler];
+    if (handler <= HANDLER_SLTU) {
+        snprintf(text, size, "%s x%d, x%d, x%d", name, decoded->rd, decoded->rs1, decoded->rs2);
+    } else if (handler <= HANDLER_SLTIU) {
+        snprintf(text, size, "%s x%d, x%d, %d", name, decoded->rd, decoded->rs1, decoded->imm);
+    } else if (handler <= HANDLER_LHU || handler == HANDLER_JALR) {
+        snprintf(text, size, "%s x%d, %d(x%d)", name, decoded->rd, decoded->imm, decoded->rs1);
+    } else if (handler <= HANDLER_SW) {
+        snprintf(text, size, "%s x%d, %d(x%d)", name, decoded->rs2, decoded->imm, decoded->rs1);
+    } else if (handler <= HANDLER_BGEU) {
+        snprintf(text, size, "%s x%d, x%d, 0x%03x", name, decoded->rs1, decoded->rs2, address + decoded->imm);
+    } else if (handler == HANDLER_JAL) {
+        snprintf(text, size, "%s x%d, 0x%03x", name, decoded->rd, address + decoded->imm);
+    } else if (handler == HANDLER_LUI) {
+        snprintf(text, size, "%s x%d, 0x%x", name, decoded->rd, (unsigned int) decoded->imm & 0xfffff);
+    } else if (handler == HANDLER_LR) {
+        snprintf(text, size, "%s x%d, (x%d)", name, decoded->rd, decoded->rs1);
+    } else if (handler >= HANDLER_AMOADD && handler <= HANDLER_SC) {
+        snprintf(text, size, "%s x%d, x%d, (x%d)", name, decoded->rd, decoded->rs2, decoded->rs1);
+    } else {
+        snprintf(text, size, "%s", name);
+    }
+}
+
+// Renders a trace file as one line per instruction: its number in the run,
+// address, encoding and assembly, then the value written to rd and the
+// address accessed if any. Returns 0 if the file isn't a whole trace.
+int print_trace(const char* path, FILE* out) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    TraceHeader header;
+    int failed = fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, "MIT", 4) != 0 || header.version != TRACE_VERSION;
+    if (!failed && header.dropped > 0) {
+        fprintf(out, "(%llu earlier instructions not kept)\n", (unsigned long long) header.dropped);
+    }
+    for (uint64_t i = 0; i < header.count && !failed; i++) {
+        TraceEntry entry;
+        if (fread(&entry, sizeof(entry), 1, file) != 1) {
+            failed = 1;
+            break;
+        }
+        DecodedInstruction decoded;
+        char text[48];
+        decode_instruction(&decoded, entry.instruction);
+        format_instruction(text, sizeof(text), &decoded, entry.program_counter);
+        int has_rd = decoded.rd != 0 && decoded.handler != HANDLER_NOT_IMPLEMENTED;
+        int has_address = (decoded.handler >= HANDLER_LB && decoded.handler <= HANDLER_SW)
+            || (decoded.handler >= HANDLER_AMOADD && decoded.handler <= HANDLER_SC);
+        fprintf(out, "%12llu  %03x  %08x  %-*s", (unsigned long long) (header.dropped + i),
+            entry.program_counter, entry.instruction, has_rd || has_address ? 26 : 0, text);
+        if (has_rd) {
+            fprintf(out, "  x%d = 0x%08x", decoded.rd, entry.rd_value);
+        }
+        if (has_address) {
+            fprintf(out, "  [0x%04x]", entry.address);
+        }
+        fputc('\n', out);
+    }
+    fclose(file);
+    if (failed) {
+        fprintf(stderr, "%s is not a complete trace\n", path);
+    }
+    return !failed;
+}
+
+// Run statistics
+//
+// Instructions are counted a straight run at a time: every control transfer
+// adds those from where the last one landed up to itself, and the run the
+// program stopped in is added when it stops.
+double read_seconds(void) {
+#if defined(__unix__)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// After a control transfer, or when execution starts with instruction NULL
+void count_jump(VirtualMachine* vm, DecodedInstruction* instruction) {
+    RunStats* stats = vm->stats;
+    if (instruction != NULL && stats->landing <= 1020) {
+        unsigned int last = instruction - vm->decoded_instructions;
+        // A fused compare or addi with a branch transfers at its second half
+        last += instruction->handler >= HANDLER_SLT_BNE && instruction->handler <= HANDLER_ADDI_BLT;
+        stats->instructions += last - stats->landing / 4 + 1;
+    }
+    stats->landing = vm->program_counter;
+}
+
+void clear_stats(RunStats* stats) {
+    FILE* out = stats->out;
+    memset(stats, 0, sizeof(*stats));
+    stats->out = out;
+}
+
+void write_stats(VirtualMachine* vm) {
+    RunStats* stats = vm->stats;
+    const char* regions[] = {"instruction", "data", "routines", "heap"};
+    fprintf(stats->out, "{\"status\":\"%s\",\"exit_status\":%d,\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f",
+        vm->stop_reason == STOP_HALTED ? "halted" : "error", vm->exit_status, (unsigned long long) stats->instructions,
+        stats->seconds, stats->seconds > 0 ? stats->instructions / stats->seconds / 1e6 : 0.0);
+    for (int store = 0; store < 2; store++) {
+        uint64_t* counts = store ? stats->stores : stats->loads;
+        fprintf(stats->out, ",\"%s\":{", store ? "stores" : "loads");
+        for (int kind = PAGE_INSTRUCTION; kind <= PAGE_HEAP; kind++) {
+            fprintf(stats->out, "%s\"%s\":%llu", kind > PAGE_INSTRUCTION ? "," : "", regions[kind - PAGE_INSTRUCTION],
+                (unsigned long long) counts[kind]);
+        }
+        fprintf(stats->out, "}");
+    }
+    fprintf(stats->out, ",\"heap\":{\"allocations\":%llu,\"failed_allocations\":%llu,\"frees\":%llu,\"high_water_bytes\":%d}",
+        (unsigned long long) stats->allocations, (unsigned long long) stats->failed_allocations,
+        (unsigned long long) stats->frees, stats->heap_banks * 64);
+    fprintf(stats->out, ",\"console\":{\"input_bytes\":%llu,\"output_bytes\":%llu}}\n",
+        (unsigned long long) stats->input_bytes, (unsigned long long) stats->output_bytes);
+    fflush(stats->out);
+}
+
+// Adds the run execution stopped in and the time since start. The
+// instruction that halted or failed counts, one it stopped before doesn't.
+void count_stop(VirtualMachine* vm, double start) {
+    RunStats* stats = vm->stats;
+    int ran = vm->stop_reason == STOP_HALTED || vm->stop_reason == STOP_ERROR;
+    unsigned int end = vm->program_counter <= 1020 ? vm->program_counter / 4 + ran : 256;
+    if (stats->landing <= 1020 && end >= stats->landing / 4) {
+        stats->instructions += end - stats->landing / 4;
+    }
+    stats->landing = vm->program_counter;
+    stats->seconds += read_seconds() - start;
+}
+
+// Execute instructions
+//
+// Built with THREADED_DISPATCH (see Makefile) every handler jumps straight to
+// the next instruction's handler through a table of label addresses (GCC and
+// Clang computed goto). Otherwise the same handler bodies become the cases of
+// a portable switch.
+//
+// Profiling and tracing swap in a table that sends every instruction to the
+// profiler and tracer first, so a run without either pays nothing for them.
+#if defined(THREADED_DISPATCH)
+#define HANDLER(name) handler_##name
+#define NEXT() \
+    instruction = &(vm->decoded_instructions[vm->program_counter / 4]); \
+    goto *handlers[instruction->handler]
+#else
+#define HANDLER(name) case HANDLER_##name
+#define NEXT() continue
+#endif
+
+// Control transfers may land anywhere, falling through can at most reach the
+// guard entry after the last instruction. Block entries go through the JIT
+// and are charged to the quantum once they start, so every quantum runs at
+// least one block however short it is.
+#define JUMP() \
+    if (vm->stats != NULL) { \
+        count_jump(vm, instruction); \
+    } \
+    if (vm->jit_enabled) { \
+        run_native_blocks(vm); \
+    } \
+    if (vm->program_counter > 1020) { \
+        illegal_operation(vm); \
+    } \
+    if (vm->coverage_map != NULL) { \
+        record_edge(vm); \
+    } \
+    if (vm->instruction_budget <= 0 || is_stop_requested(vm)) { \
+        return STOP_QUANTUM_EXPIRED; \
+    } \
+    vm->instruction_budget -= get_block_cost(vm, vm->program_counter); \
+    NEXT()
+
+// AFL-style edge coverage: every control transfer bumps the counter of the
+// (previous block, this block) pair. The previous id is halved so that A -> B
+// and B -> A count apart.
+void record_edge(VirtualMachine* vm) {
+    unsigned int location = ((vm->program_counter / 4) * 0x9e3779b1u) >> 16;
+    vm->coverage_map[(location ^ vm->coverage_previous) & vm->coverage_mask]++;
+    vm->coverage_previous = location >> 1;
+}
+
+// Instructions charged for landing at an address
+int get_block_cost(VirtualMachine* vm, unsigned int address) {
+    int length = vm->basic_blocks[address / 4].length;
+    return length > 0 ? length : 1;
+}
+
+int execute_instructions(VirtualMachine* vm) {
+    DecodedInstruction* instruction = NULL;
+
+#if defined(THREADED_DISPATCH)
+    static void* dispatch_table[] = {
+        [HANDLER_ADD] = &&handler_ADD, [HANDLER_SUB] = &&handler_SUB,
+        [HANDLER_XOR] = &&handler_XOR, [HANDLER_OR] = &&handler_OR,
+        [HANDLER_AND] = &&handler_AND, [HANDLER_SLL] = &&handler_SLL,
+        [HANDLER_SRL] = &&handler_SRL, [HANDLER_SRA] = &&handler_SRA,
+        [HANDLER_SLT] = &&handler_SLT, [HANDLER_SLTU] = &&handler_SLTU,
+        [HANDLER_ADDI] = &&handler_ADDI, [HANDLER_XORI] = &&handler_XORI,
+        [HANDLER_ORI] = &&handler_ORI, [HANDLER_ANDI] = &&handler_ANDI,
+        [HANDLER_SLTI] = &&handler_SLTI, [HANDLER_SLTIU] = &&handler_SLTIU,
+        [HANDLER_LB] = &&handler_LB, [HANDLER_LH] = &&handler_LH,
+        [HANDLER_LW] = &&handler_LW, [HANDLER_LBU] = &&handler_LBU,
+        [HANDLER_LHU] = &&handler_LHU, [HANDLER_SB] = &&handler_SB,
+        [HANDLER_SH] = &&handler_SH, [HANDLER_SW] = &&handler_SW,
+        [HANDLER_BEQ] = &&handler_BEQ, [HANDLER_BNE] = &&handler_BNE,
+        [HANDLER_BLT] = &&handler_BLT, [HANDLER_BGE] = &&handler_BGE,
+        [HANDLER_BLTU] = &&handler_BLTU, [HANDLER_BGEU] = &&handler_BGEU,
+        [HANDLER_JAL] = &&handler_JAL, [HANDLER_JALR] = &&handler_JALR,
+        [HANDLER_LUI] = &&handler_LUI,
+        [HANDLER_AMOADD] = &&handler_AMOADD, [HANDLER_AMOSWAP] = &&handler_AMOSWAP,
+        [HANDLER_LR] = &&handler_LR, [HANDLER_SC] = &&handler_SC,
+        [HANDLER_FENCE] = &&handler_FENCE,
+        [HANDLER_LUI_ADDI] = &&handler_LUI_ADDI, [HANDLER_LUI_LW] = &&handler_LUI_LW,
+        [HANDLER_LUI_SW] = &&handler_LUI_SW, [HANDLER_SLT_BNE] = &&handler_SLT_BNE,
+        [HANDLER_SLT_BEQ] = &&handler_SLT_BEQ, [HANDLER_SLTU_BNE] = &&handler_SLTU_BNE,
+        [HANDLER_SLTU_BEQ] = &&handler_SLTU_BEQ, [HANDLER_ADDI_BNE] = &&handler_ADDI_BNE,
+        [HANDLER_ADDI_BLT] = &&handler_ADDI_BLT,
+        [HANDLER_NOT_IMPLEMENTED] = &&handler_NOT_IMPLEMENTED,
+        [HANDLER_BREAKPOINT] = &&handler_BREAKPOINT,
+        [HANDLER_END_OF_MEMORY] = &&handler_END_OF_MEMORY
+    };
+    static void* profile_table[] = {[0 ... HANDLER_PROFILE] = &&handler_PROFILE};
+    void** handlers = vm->profile != NULL || vm->trace != NULL ? profile_table : dispatch_table;
+
+    JUMP();
+#else
+    uint8_t handler;
+    while (1) {
+        instruction = &(vm->decoded_instructions[vm->program_counter / 4]);
+        handler = vm->profile != NULL || vm->trace != NULL ? HANDLER_PROFILE : instruction->handler;
+
+    dispatch:
+        switch (handler) {
+#endif
+    // Logic and arithmetic
+    HANDLER(ADD):
+        add(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SUB):
+        sub(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(XOR):
+        xor(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(OR):
+        or(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(AND):
+        and(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLL):
+        sll(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SRL):
+        srl(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SRA):
+        sra(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLT):
+        slt(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLTU):
+        sltu(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(ADDI):
+        addi(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(XORI):
+        xori(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(ORI):
+        ori(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(ANDI):
+        andi(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLTI):
+        slti(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLTIU):
+        sltiu(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LUI):
+        lui(vm, instruction->rd, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    // Memory
+    HANDLER(LB):
+        lb(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LH):
+        lh(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LW):
+        lw(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LBU):
+        lbu(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LHU):
+        lhu(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SB):
+        sb(vm, instruction->rs1, instruction->imm, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SH):
+        sh(vm, instruction->rs1, instruction->imm, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SW):
+        sw(vm, instruction->rs1, instruction->imm, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    // Atomics
+    HANDLER(AMOADD):
+    HANDLER(AMOSWAP):
+    HANDLER(LR):
+    HANDLER(SC):
+        atomic_memory_operation(vm, instruction->handler, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(FENCE):
+        fence();
+        vm->program_counter += 4;
+        NEXT();
+    // Program flow, these set the program counter themselves
+    HANDLER(BEQ):
+        beq(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(BNE):
+        bne(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(BLT):
+        blt(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(BGE):
+        bge(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(BLTU):
+        bltu(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(BGEU):
+        bgeu(vm, instruction->rs1, instruction->rs2, instruction->imm);
+        JUMP();
+    HANDLER(JAL):
+        jal(vm, instruction->rd, instruction->imm);
+        JUMP();
+    HANDLER(JALR):
+        jalr(vm, instruction->rd, instruction->rs1, instruction->imm);
+        JUMP();
+    // Superinstructions, the second instruction is the next decoded entry
+    HANDLER(LUI_ADDI):
+        vm->registers[instruction->rd] = ((unsigned int) instruction->imm << 12) + instruction[1].imm;
+        vm->program_counter += 8;
+        NEXT();
+    // Routines and errors see the program counter of the load or store
+    HANDLER(LUI_LW):
+        lui(vm, instruction->rd, instruction->imm);
+        vm->program_counter += 4;
+        lw(vm, instruction[1].rd, instruction[1].rs1, instruction[1].imm);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(LUI_SW):
+        lui(vm, instruction->rd, instruction->imm);
+        vm->program_counter += 4;
+        sw(vm, instruction[1].rs1, instruction[1].imm, instruction[1].rs2);
+        vm->program_counter += 4;
+        NEXT();
+    HANDLER(SLT_BNE):
+        slt(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        bne(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(SLT_BEQ):
+        slt(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        beq(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(SLTU_BNE):
+        sltu(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        bne(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(SLTU_BEQ):
+        sltu(vm, instruction->rd, instruction->rs1, instruction->rs2);
+        vm->program_counter += 4;
+        beq(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(ADDI_BNE):
+        addi(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        bne(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(ADDI_BLT):
+        addi(vm, instruction->rd, instruction->rs1, instruction->imm);
+        vm->program_counter += 4;
+        blt(vm, instruction[1].rs1, instruction[1].rs2, instruction[1].imm);
+        JUMP();
+    HANDLER(END_OF_MEMORY):
+        illegal_operation(vm);
+        NEXT();
+    HANDLER(NOT_IMPLEMENTED):
+        fake_instruction(vm, get_instruction_word(vm, vm->program_counter));
+        stop_virtual_machine(vm, STOP_ERROR);
+        return STOP_ERROR;
+    HANDLER(BREAKPOINT):
+        return STOP_BREAKPOINT;
+    HANDLER(PROFILE):
+        if (vm->profile != NULL) {
+            profile_instruction(vm, instruction);
+        }
+#if defined(THREADED_DISPATCH)
+        if (vm->trace != NULL) {
+            goto *dispatch_table[trace_instruction(vm, instruction)];
+        }
+        goto *dispatch_table[instruction->handler];
+#else
+        handler = vm->trace != NULL ? trace_instruction(vm, instruction) : instruction->handler;
+        goto dispatch;
+#endif
+#if !defined(THREADED_DISPATCH)
+        }
+    }
+#endif
+	return STOP_HALTED;
+}
+
+#undef HANDLER
+#undef NEXT
+#undef JUMP
+
+void init_virtual_machine(VirtualMachine* vm) {
+    init_page_table(vm);
+    vm->first_hart = vm;
+    vm->reservation = 1;
+    vm->output.stream = stdout;
+    set_output_buffer_size(vm, OUTPUT_BUFFER_SIZE);
+    vm->input.stream = stdin;
+    vm->instruction_budget = INT64_MAX;
+    vm->breakpoint = -1;
+    memset(&(vm->heap), 0, sizeof(vm->heap));
+    vm->heap.free_banks[0] = ~(uint64_t) 0;
+    vm->heap.free_banks[1] = ~(uint64_t) 0;
+}
+
+// Releases the buffers, input mapping and native code of a VM. Streams
+// belong to the caller.
+void destroy_virtual_machine(VirtualMachine* vm) {
+    stop_harts(vm);
+    flush_output(vm);
+    free(vm->output.data);
+    vm->output.data = NULL;
+    vm->output.size = 0;
+    close_input(vm);
+    free(vm->pristine_heap);
+    vm->pristine_heap = NULL;
+    free_profile(vm->profile);
+    vm->profile = NULL;
+    free(vm->stats);
+    vm->stats = NULL;
+    free_trace(vm->trace);
+    vm->trace = NULL;
+#if defined(JIT_SUPPORTED)
+    if (vm->jit_code != NULL) {
+        munmap(vm->jit_code, JIT_CODE_SIZE);
+        vm->jit_code = NULL;
+    }
+#endif
+}
+
+// Runs the loaded program from its program counter for about quantum
+// instructions, or without a limit if quantum is 0, and returns why it
+// stopped. Output stays buffered unless the program halted.
+uint8_t resume_virtual_machine(VirtualMachine* vm, int64_t quantum) {
+    jmp_buf exit_point;
+    double start = 0;
+    vm->instruction_budget = quantum > 0 ? quantum : INT64_MAX;
+    vm->exit_point = &exit_point;
+    if (vm->stats != NULL) {
+        start = read_seconds();
+        vm->stats->landing = vm->program_counter;
+    }
+    if (setjmp(exit_point) == 0) {
+        vm->stop_reason = execute_instructions(vm);
+    }
+    vm->exit_point = NULL;
+    if (vm->stats != NULL) {
+        count_stop(vm, start);
+    }
+    if (check_harts(vm)) {
+        // Whatever the other harts printed before they were stopped
+        flush_output(vm);
+    }
+    // A record for every run of the program
+    if (vm->stats != NULL && (vm->stop_reason == STOP_HALTED || vm->stop_reason == STOP_ERROR)) {
+        write_stats(vm);
+        clear_stats(vm->stats);
+    }
+    return vm->stop_reason;
+}
+
+// Runs the loaded program until it halts or fails and returns its exit
+// status instead of exiting the process
+int run_virtual_machine(VirtualMachine* vm) {
+    uint8_t reason;
+    do {
+        reason = resume_virtual_machine(vm, 0);
+    } while (reason != STOP_HALTED && reason != STOP_ERROR);
+    return vm->exit_status;
+}
+
+// Reads a .mi image straight into instruction and data memory with one
+// unbuffered read. Images must be exactly 2 KiB.
+int load_image(VirtualMachine* vm, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("error opening file");
+        return 0;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+    size_t count = fread(vm->memory, 1, sizeof(vm->memory), file);
+    int extra = count == sizeof(vm->memory) ? fgetc(file) : EOF;
+    int failed = ferror(file);
+    fclose(file);
+
+    if (failed) {
+        fprintf(stderr, "error reading %s\n", path);
+        return 0;
+    } else if (count < sizeof(vm->memory)) {
+        fprintf(stderr, "%s: truncated image, %zu of %zu bytes\n", path, count, sizeof(vm->memory));
+        return 0;
+    } else if (extra != EOF) {
+        fprintf(stderr, "%s: image is larger than %zu bytes\n", path, sizeof(vm->memory));
+        return 0;
+    }
+    return 1;
+}
+
+// Decode the loaded image and find its basic blocks and superinstructions
+void prepare_instructions(VirtualMachine* vm) {
+    predecode_instructions(vm);
+    find_basic_blocks(vm);
+    fuse_instructions(vm);
+}
+
+// Precompiled image cache
+//
+// A .mic file holds what prepare_instructions() derives from an image: the
+// decoded and fused instruction stream and the basic block lengths, next to
+// the image itself (instructions and initial data segment). Files are named
+// after the FNV-1a hash of the image and only used if the stored image
+// matches byte for byte, so a stale or colliding entry is just a miss.
+// Bump the version whenever decoding or fusion changes what is derived.
+#define COMPILED_IMAGE_VERSION 2
+
+struct compiled_image {
+    char magic[4]; // "MIC\0"
+    uint32_t version;
+    uint64_t image_hash;
+    uint32_t handler_count; // layout checks, the file is a raw host dump
+    uint32_t decoded_size;
+    uint8_t memory[2048];
+    DecodedInstruction decoded_instructions[257];
+    uint16_t block_lengths[256];
+};
+typedef struct compiled_image CompiledImage;
+
+uint64_t hash_image(const uint8_t* image, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ image[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+void get_compiled_image_path(char* path, size_t size, const char* cache_directory, uint64_t hash) {
+    snprintf(path, size, "%s/%016llx.mic", cache_directory, (unsigned long long) hash);
+}
+
+void fill_compiled_image_header(CompiledImage* compiled, uint64_t hash) {
+    memcpy(compiled->magic, "MIC", 4);
+    compiled->version = COMPILED_IMAGE_VERSION;
+    compiled->image_hash = hash;
+    compiled->handler_count = HANDLER_END_OF_MEMORY + 1;
+    compiled->decoded_size = sizeof(DecodedInstruction);
+}
+
+// Whether every record is one this build could have written: known handlers
+// and registers, and blocks that end inside the image
+int check_compiled_image(CompiledImage* compiled) {
+    for (int i = 0; i < 257; i++) {
+        DecodedInstruction* instruction = &(compiled->decoded_instructions[i]);
+        if (instruction->handler >= compiled->handler_count || instruction->rd >= 32 || instruction->rs1 >= 32 ||
+            instruction->rs2 >= 32) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        if (compiled->block_lengths[i] > 256 - i) {
+            return 0;
+        }
+    }
+    return compiled->block_lengths[0] > 0;
+}
+
+// Returns 1 and fills in the decoded instructions and blocks on a hit
+int load_compiled_image(VirtualMachine* vm, const char* path, uint64_t hash) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    CompiledImage* compiled = malloc(sizeof(CompiledImage));
+    CompiledImage expected;
+    int hit = 0;
+    setvbuf(file, NULL, _IONBF, 0);
+    if (compiled != NULL && fread(compiled, sizeof(CompiledImage), 1, file) == 1) {
+        fill_compiled_image_header(&expected, hash);
+        hit = memcmp(compiled, &expected, offsetof(CompiledImage, memory)) == 0
+            && memcmp(compiled->memory, vm->memory, sizeof(vm->memory)) == 0
+            && check_compiled_image(compiled);
+    }
+    fclose(file);
+
+    if (hit) {
+        memcpy(vm->decoded_instructions, compiled->decoded_instructions, sizeof(vm->decoded_instructions));
+        for (int i = 0; i < 256; i++) {
+            vm->basic_blocks[i].length = compiled->block_lengths[i];
+        }
+    }
+    free(compiled);
+    return hit;
+}
+
+// Written under a temporary name and renamed into place, so readers never
+// see a partial file. Failing to cache is not an error.
+void save_compiled_image(VirtualMachine* vm, const char* path, uint64_t hash) {
+    CompiledImage* compiled = calloc(1, sizeof(CompiledImage));
+    char temporary_path[4096];
+    if (compiled == NULL) {
+        return;
+    }
+    fill_compiled_image_header(compiled, hash);
+    memcpy(compiled->memory, vm->memory, sizeof(vm->memory));
+    memcpy(compiled->decoded_instructions, vm->decoded_instructions, sizeof(vm->decoded_instructions));
+    for (int i = 0; i < 256; i++) {
+        compiled->block_lengths[i] = vm->basic_blocks[i].length;
+    }
+
+#if defined(INPUT_MMAP)
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%ld.tmp", path, (long) getpid());
+#else
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+#endif
+    FILE* file = fopen(temporary_path, "wbx");
+    if (file != NULL) {
+        int written = fwrite(compiled, sizeof(CompiledImage), 1, file) == 1;
+        if (fclose(file) == 0 && written) {
+            rename(temporary_path, path);
+        } else {
+            remove(temporary_path);
+        }
+    }
+    free(compiled);
+}
+
+// prepare_instructions() through the cache directory, if there is one
+void prepare_cached_instructions(VirtualMachine* vm, const char* cache_directory) {
+    char path[4096];
+    if (cache_directory == NULL || cache_directory[0] == '\0') {
+        prepare_instructions(vm);
+        return;
+    }
+    uint64_t hash = hash_image(vm->memory, sizeof(vm->memory));
+    get_compiled_image_path(path, sizeof(path), cache_directory, hash);
+    if (!load_compiled_image(vm, path, hash)) {
+        prepare_instructions(vm);
+        save_compiled_image(vm, path, hash);
+    }
+}
+
+// Puts the VM back as the image was loaded (or its snapshot restored) for
+// another run. Only the data words written since are copied back and the
+// decoded instructions and native code are kept, instruction memory never
+// changes. Allocations are zeroed by malloc, so freeing every heap bank is
+// enough unless the starting state had some.
+void reset_virtual_machine(VirtualMachine* vm) {
+    stop_harts(vm);
+    for (int i = 0x400 / 4; i < 0x800 / 4; i += 8) {
+        uint64_t dirty;
+        memcpy(&dirty, vm->dirty_words + i, sizeof(dirty));
+        if (dirty == 0) {
+            continue;
+        }
+        for (int j = i; j < i + 8; j++) {
+            if (vm->dirty_words[j]) {
+                memcpy(vm->memory + j * 4, vm->pristine_data + j * 4 - 0x400, 4);
+                vm->dirty_words[j] = 0;
+            }
+        }
+    }
+    memcpy(vm->registers, vm->pristine_registers, sizeof(vm->registers));
+    vm->program_counter = vm->pristine_program_counter;
+    vm->coverage_previous = 0;
+    vm->reservation = 1;
+    if (vm->profile != NULL) {
+        restart_call_graph(vm->profile);
+    }
+    if (vm->stats != NULL) {
+        clear_stats(vm->stats);
+    }
+    if (vm->pristine_heap != NULL) {
+        vm->heap = *(vm->pristine_heap);
+    } else {
+        vm->heap.free_banks[0] = ~(uint64_t) 0;
+        vm->heap.free_banks[1] = ~(uint64_t) 0;
+    }
+    vm->exit_status = 0;
+}
+
+// Decodes a freshly loaded image and clears what the previous one left in
+// the registers, heap and native code
+void start_loaded_image(VirtualMachine* vm) {
+    // Native code belongs to the previous image
+    memset(vm->basic_blocks, 0, sizeof(vm->basic_blocks));
+    vm->jit_code_used = 0;
+    vm->breakpoint = -1;
+    prepare_cached_instructions(vm, vm->cache_directory);
+    memcpy(vm->pristine_data, vm->memory + 0x400, sizeof(vm->pristine_data));
+    memset(vm->dirty_words, 0, sizeof(vm->dirty_words));
+    memset(vm->pristine_registers, 0, sizeof(vm->pristine_registers));
+    vm->pristine_program_counter = 0;
+    free(vm->pristine_heap);
+    vm->pristine_heap = NULL;
+    reset_virtual_machine(vm);
+}
+
+// Ahead-of-time translation to C
+//
+// The generated translation unit includes this file for the memory handlers,
+// virtual routines and heap, keeps the guest registers in locals and has one
+// label per reachable instruction. jalr and any other computed jump goes
+// through a switch over those labels and falls back to the interpreter for
+// addresses the translation doesn't know about.
+void mark_reachable(VirtualMachine* vm, uint8_t* reachable, unsigned int address, int* worklist, int* pending) {
+    if (address > 1020 || address % 4 != 0 || reachable[address / 4]) {
+        return;
+    }
+    reachable[address / 4] = 1;
+    worklist[(*pending)++] = address / 4;
+}
+
+void find_reachable_instructions(VirtualMachine* vm, uint8_t* reachable) {
+    int worklist[256];
+    int pending = 0;
+
+    mark_reachable(vm, reachable, 0, worklist, &pending);
+    while (pending > 0) {
+        int index = worklist[--pending];
+        DecodedInstruction* instruction = &(vm->decoded_instructions[index]);
+        uint8_t handler = get_first_handler(instruction->handler);
+        unsigned int address = index * 4;
+
+        if (handler == HANDLER_NOT_IMPLEMENTED) {
+            continue;
+        }
+        // Fall through, or the return address of a jal/jalr
+        mark_reachable(vm, reachable, address + 4, worklist, &pending);
+        if (handler >= HANDLER_BEQ && handler <= HANDLER_JAL) {
+            mark_reachable(vm, reachable, address + instruction->imm, worklist, &pending);
+        }
+    }
+}
+
+// Guest register as a C expression
+const char* aot_register(char* name, uint8_t index) {
+    if (index == 0) {
+        strcpy(name, "0u");
+    } else {
+        sprintf(name, "x%d", index);
+    }
+    return name;
+}
+
+// Backward jumps check for a failed hart, so that a loop can't keep the
+// translated first hart from stopping
+void emit_aot_jump(FILE* out, uint8_t* reachable, unsigned int address, unsigned int target) {
+    if (target <= address && target % 4 == 0 && reachable[target / 4]) {
+        fprintf(out, "{ CHECK_STOP(); goto L_%03x; }", target);
+    } else if (target <= 1020 && target % 4 == 0 && reachable[target / 4]) {
+        fprintf(out, "goto L_%03x;", target);
+    } else {
+        fprintf(out, "{ pc = 0x%08xu; goto dispatch; }", target);
+    }
+}
+
+void emit_aot_instruction(VirtualMachine* vm, FILE* out, uint8_t* reachable, int index) {
+    DecodedInstruction* instruction = &(vm->decoded_instructions[index]);
+    uint8_t handler = get_first_handler(instruction->handler);
+    unsigned int address = index * 4;
+    unsigned int imm = (unsigned int) instruction->imm;
+    char rd[8];
+    char rs1[8];
+    char rs2[8];
+    const char* operation = NULL;
+    const char* access_type = "uint32_t";
+    int size = 4;
+
+    aot_register(rd, instruction->rd);
+    aot_register(rs1, instruction->rs1);
+    aot_register(rs2, instruction->rs2);
+
+    fprintf(out, "L_%03x: /* %s */\n    ", address, handler_names[handler]);
+
+    switch (handler) {
+        case HANDLER_ADD: case HANDLER_ADDI: operation = "+"; break;
+        case HANDLER_SUB: operation = "-"; break;
+        case HANDLER_XOR: case HANDLER_XORI: operation = "^"; break;
+        case HANDLER_OR: case HANDLER_ORI: operation = "|"; break;
+        case HANDLER_AND: case HANDLER_ANDI: operation = "&"; break;
+        // Registers are unsigned, so signed and unsigned comparisons agree
+        case HANDLER_SLT: case HANDLER_SLTU: case HANDLER_SLTI: case HANDLER_SLTIU:
+        case HANDLER_BLT: case HANDLER_BLTU: operation = "<"; break;
+        case HANDLER_BGE: case HANDLER_BGEU: operation = ">="; break;
+        case HANDLER_BEQ: operation = "=="; break;
+        case HANDLER_BNE: operation = "!="; break;
+        case HANDLER_SLL: operation = "<<"; break;
+        case HANDLER_SRL: operation = ">>"; break;
+        case HANDLER_LB: access_type = "int8_t"; size = 1; break;
+        case HANDLER_LBU: case HANDLER_SB: access_type = "uint8_t"; size = 1; break;
+        case HANDLER_LH: access_type = "int16_t"; size = 2; break;
+        case HANDLER_LHU: case HANDLER_SH: access_type = "uint16_t"; size = 2; break;
+    }
+
+    switch (handler) {
+        case HANDLER_ADD:
+        case HANDLER_SUB:
+        case HANDLER_XOR:
+        case HANDLER_OR:
+        case HANDLER_AND:
+        case HANDLER_SLT:
+        case HANDLER_SLTU:
+            if (instruction->rd != 0 && (handler == HANDLER_SLT || handler == HANDLER_SLTU) && instruction->rs1 == instruction->rs2) {
+                fprintf(out, "%s = 0;", rd); // no register is below itself
+            } else if (instruction->rd != 0) {
+                fprintf(out, "%s = %s %s %s;", rd, rs1, operation, rs2);
+            }
+            break;
+        // Shift counts wrap like the host shift instructions the interpreter uses
+        case HANDLER_SLL:
+        case HANDLER_SRL:
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = %s %s (%s & 31);", rd, rs1, operation, rs2);
+            }
+            break;
+        case HANDLER_ADDI:
+        case HANDLER_XORI:
+        case HANDLER_ORI:
+        case HANDLER_ANDI:
+        case HANDLER_SLTI:
+        case HANDLER_SLTIU:
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = %s %s 0x%08xu;", rd, rs1, operation, imm);
+            }
+            break;
+        case HANDLER_LUI:
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = 0x%08xu;", rd, imm << 12);
+            }
+            break;
+        case HANDLER_SRA:
+            fprintf(out, "CALL(sra(vm, %d, %d, %d), %d);", instruction->rd, instruction->rs1, instruction->rs2, instruction->rd);
+            break;
+        case HANDLER_LB:
+        case HANDLER_LH:
+        case HANDLER_LW:
+        case HANDLER_LBU:
+        case HANDLER_LHU:
+            // Plain memory is read in place, anything else goes through the handler
+            fprintf(out, "if (%s + 0x%08xu <= 0x%03xu) { %s value; memcpy(&value, vm->memory + (uint32_t) (%s + 0x%08xu), %d); ",
+                rs1, imm, 0x800 - size, access_type, rs1, imm, size);
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = (unsigned int) value; ", rd);
+            }
+            fprintf(out, "} else { pc = 0x%03xu; CALL(%s(vm, %d, %d, %d), %d); }", address, handler_names[handler],
+                instruction->rd, instruction->rs1, instruction->imm, instruction->rd);
+            break;
+        // malloc returns its result in R[28]
+        case HANDLER_SB:
+        case HANDLER_SH:
+        case HANDLER_SW:
+            fprintf(out, "if (%s + 0x%08xu - 0x400u <= 0x%03xu) { %s value = %s; memcpy(vm->memory + (uint32_t) (%s + 0x%08xu), &value, %d); } ",
+                rs1, imm, 0x400 - size, access_type, rs2, rs1, imm, size);
+            fprintf(out, "else { pc = 0x%03xu; CALL(%s(vm, %d, %d, %d), 28); }", address, handler_names[handler],
+                instruction->rs1, instruction->imm, instruction->rs2);
+            break;
+        case HANDLER_BEQ:
+        case HANDLER_BNE:
+        case HANDLER_BLT:
+        case HANDLER_BGE:
+        case HANDLER_BLTU:
+        case HANDLER_BGEU:
+            if (instruction->rs1 == instruction->rs2) {
+                // Decided already, and compilers warn about comparing a register with itself
+                fprintf(out, "if (%d) ", strchr(operation, '=') != NULL && operation[0] != '!');
+            } else {
+                fprintf(out, "if (%s %s %s) ", rs1, operation, rs2);
+            }
+            emit_aot_jump(out, reachable, address, address + imm);
+            break;
+        case HANDLER_JAL:
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = 0x%03xu; ", rd, address + 4);
+            }
+            emit_aot_jump(out, reachable, address, address + imm);
+            break;
+        // rd is written before rs1 is read, as in jalr()
+        case HANDLER_JALR:
+            if (instruction->rd != 0) {
+                fprintf(out, "%s = 0x%03xu; ", rd, address + 4);
+            }
+            fprintf(out, "pc = %s + 0x%08xu; goto dispatch;", rs1, imm);
+            break;
+        case HANDLER_AMOADD:
+        case HANDLER_AMOSWAP:
+        case HANDLER_LR:
+        case HANDLER_SC:
+            fprintf(out, "pc = 0x%03xu; CALL(atomic_memory_operation(vm, %d, %d, %d, %d), %d);", address, handler,
+                instruction->rd, instruction->rs1, instruction->rs2, instruction->rd);
+            break;
+        case HANDLER_FENCE:
+            fprintf(out, "fence();");
+            break;
+        default:
+            fprintf(out, "pc = 0x%03xu; SYNC_OUT(); fake_instruction(vm, 0x%08x); return 1;",
+                address, get_instruction_word(vm, address));
+            break;
+    }
+    fprintf(out, "\n");
+}
+
+void emit_aot_translation(VirtualMachine* vm, FILE* out, const char* image_path) {
+    uint8_t reachable[256] = {0};
+    find_reachable_instructions(vm, reachable);
+
+    fprintf(out, "// Translated from %s by vm_riskxvii --aot\n", image_path);
+    fprintf(out, "// Build with: gcc -O2 -I<directory of libriskxvii.c> <this file> -o <program>\n");
+    fprintf(out, "#include \"libriskxvii.c\"\n\n");
+    fprintf(out, "#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n");
+
+    fprintf(out, "static const unsigned char image[2048] = {");
+    for (int i = 0; i < 2048; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", vm->memory[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    // Handlers work on vm->registers, so the locals are written out around
+    // every call and the register it may change is read back
+    fprintf(out, "#define SYNC_OUT() vm->program_counter = pc;");
+    for (int i = 1; i < 32; i++) {
+        fprintf(out, " \\\n    vm->registers[%d] = x%d;", i, i);
+    }
+    fprintf(out, "\n#define CALL(call, written) do { SYNC_OUT(); call; \\\n");
+    fprintf(out, "    switch (written) {");
+    for (int i = 1; i < 32; i++) {
+        fprintf(out, "%scase %d: x%d = vm->registers[%d]; break;", i % 4 == 1 ? " \\\n        " : " ", i, i, i);
+    }
+    fprintf(out, " \\\n    } } while (0)\n");
+    // Only harts that fail set the flag of a translated program
+    fprintf(out, "#define CHECK_STOP() if (is_stop_requested(vm)) stop_virtual_machine(vm, STOP_ERROR)\n\n");
+
+    fprintf(out, "static int run_translation(VirtualMachine* vm) {\n");
+    fprintf(out, "    unsigned int pc = 0;\n");
+    for (int i = 1; i < 32; i++) {
+        fprintf(out, "    unsigned int x%d = 0;\n", i);
+    }
+    fprintf(out, "\n");
+    for (int i = 0; i < 256; i++) {
+        if (reachable[i]) {
+            emit_aot_instruction(vm, out, reachable, i);
+        }
+        // Falling off the last reachable instruction
+        if (reachable[i] && (i == 255 || !reachable[i + 1])) {
+            fprintf(out, "    pc = 0x%03x; goto dispatch;\n", (i + 1) * 4);
+        }
+    }
+
+    fprintf(out, "\ndispatch:\n    CHECK_STOP();\n    switch (pc) {\n");
+    for (int i = 0; i < 256; i++) {
+        if (reachable[i]) {
+            fprintf(out, "        case 0x%03x: goto L_%03x;\n", i * 4, i * 4);
+        }
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "    // Not a translated instruction, the interpreter takes over\n");
+    fprintf(out, "    SYNC_OUT();\n");
+    fprintf(out, "    if (vm->program_counter > 1020) {\n");
+    fprintf(out, "        illegal_operation(vm);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    execute_instructions(vm);\n");
+    fprintf(out, "    // It only returns early when a hart failed\n");
+    fprintf(out, "    stop_virtual_machine(vm, STOP_ERROR);\n");
+    fprintf(out, "    return 1;\n");
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    static VirtualMachine vm;\n");
+    fprintf(out, "    init_virtual_machine(&vm);\n");
+    fprintf(out, "    memcpy(vm.memory, image, sizeof(image));\n");
+    fprintf(out, "    prepare_instructions(&vm);\n");
+    fprintf(out, "    return run_translation(&vm);\n");
+    fprintf(out, "}\n");
+}
+
+
+// Breakpoints and snapshots
+//
+// A breakpoint swaps the handler of one decoded instruction, so the
+// interpreter returns STOP_BREAKPOINT before running it. Native code already
+// compiled past it is thrown away and the JIT never compiles across it.
+//
+// A .snap file is the VM's state between two instructions: program counter,
+// registers, instruction and data memory, heap allocations followed by the
+// contents of the allocated banks only, and how much input had been
+// consumed. Output is flushed first so none is pending. Like .mic files it
+// is a raw dump for the host that wrote it.
+#define SNAPSHOT_VERSION 1
+
+struct snapshot {
+    char magic[4]; // "MIS\0"
+    uint32_t version;
+    unsigned int program_counter;
+    unsigned int registers[32];
+    uint64_t input_position;
+    uint64_t free_banks[2];
+    uint8_t first_bank[128];
+    uint8_t banks_used[128];
+    uint8_t memory[2048];
+};
+typedef struct snapshot Snapshot;
+
+void discard_native_code(VirtualMachine* vm) {
+    for (int i = 0; i < 256; i++) {
+        vm->basic_blocks[i].native_code = NULL;
+        vm->basic_blocks[i].jit_failed = 0;
+        vm->basic_blocks[i].entry_count = 0;
+    }
+    vm->jit_code_used = 0;
+}
+
+void clear_breakpoint(VirtualMachine* vm) {
+    int index = vm->breakpoint;
+    if (index < 0) {
+        return;
+    }
+    if (index > 0) {
+        vm->decoded_instructions[index - 1] = vm->breakpoint_saved[0];
+    }
+    vm->decoded_instructions[index] = vm->breakpoint_saved[1];
+    vm->breakpoint = -1;
+    // Blocks that stopped short of the breakpoint can be compiled whole now
+    discard_native_code(vm);
+}
+
+int set_breakpoint(VirtualMachine* vm, unsigned int address) {
+    if (address > 1020 || address % 4 != 0) {
+        return 0;
+    }
+    clear_breakpoint(vm);
+    int index = address / 4;
+    if (index > 0) {
+        vm->breakpoint_saved[0] = vm->decoded_instructions[index - 1];
+        // A superinstruction before it would run it without dispatching
+        vm->decoded_instructions[index - 1].handler = get_first_handler(vm->decoded_instructions[index - 1].handler);
+    }
+    vm->breakpoint_saved[1] = vm->decoded_instructions[index];
+    vm->decoded_instructions[index].handler = HANDLER_BREAKPOINT;
+    vm->breakpoint = index;
+    discard_native_code(vm);
+    return 1;
+}
+
+int save_snapshot(VirtualMachine* vm, const char* path) {
+    Snapshot snapshot;
+    InputReader* input = &(vm->input);
+    // A snapshot holds one hart, and the others would go on changing memory
+    if (vm->harts != NULL) {
+        fprintf(stderr, "%s: can't save a snapshot while harts are running\n", path);
+        return 0;
+    }
+    memset(&snapshot, 0, sizeof(snapshot));
+    memcpy(snapshot.magic, "MIS", 4);
+    snapshot.version = SNAPSHOT_VERSION;
+    snapshot.program_counter = vm->program_counter;
+    memcpy(snapshot.registers, vm->registers, sizeof(snapshot.registers));
+    snapshot.input_position = (uint64_t) (input->origin + (int64_t) input->position);
+    memcpy(snapshot.free_banks, vm->heap.free_banks, sizeof(snapshot.free_banks));
+    memcpy(snapshot.first_bank, vm->heap.first_bank, sizeof(snapshot.first_bank));
+    memcpy(snapshot.banks_used, vm->heap.banks_used, sizeof(snapshot.banks_used));
+    memcpy(snapshot.memory, vm->memory, sizeof(snapshot.memory));
+    flush_output(vm);
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    int failed = fwrite(&snapshot, sizeof(snapshot), 1, file) != 1;
+    for (int bank = 0; bank < 128; bank++) {
+        if (!is_bank_free(&(vm->heap), bank)) {
+            failed |= fwrite(vm->heap.data + bank * 64, 64, 1, file) != 1;
+        }
+    }
+    failed |= fclose(file) != 0;
+    if (failed) {
+        fprintf(stderr, "error writing %s\n", path);
+    }
+    return !failed;
+}
+
+// Loads a snapshot as the VM's new starting state and skips the input the
+// snapshotted run had already consumed
+int restore_snapshot(VirtualMachine* vm, const char* path) {
+    Snapshot snapshot;
+    HeapMemory heap;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    int failed = fread(&snapshot, sizeof(snapshot), 1, file) != 1
+        || memcmp(snapshot.magic, "MIS", 4) != 0 || snapshot.version != SNAPSHOT_VERSION;
+    memset(&heap, 0, sizeof(heap));
+    memcpy(heap.free_banks, snapshot.free_banks, sizeof(heap.free_banks));
+    memcpy(heap.first_bank, snapshot.first_bank, sizeof(heap.first_bank));
+    memcpy(heap.banks_used, snapshot.banks_used, sizeof(heap.banks_used));
+    int allocated = 0;
+    for (int bank = 0; bank < 128 && !failed; bank++) {
+        if (!is_bank_free(&heap, bank)) {
+            failed = fread(heap.data + bank * 64, 64, 1, file) != 1;
+            allocated = 1;
+        }
+    }
+    fclose(file);
+    if (failed) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        return 0;
+    }
+
+    // Allocated before the VM changes, so that failing leaves it as it was
+    HeapMemory* pristine_heap = NULL;
+    if (allocated) {
+        pristine_heap = malloc(sizeof(HeapMemory));
+        if (pristine_heap == NULL) {
+            fprintf(stderr, "%s: out of memory\n", path);
+            return 0;
+        }
+        *pristine_heap = heap;
+    }
+
+    memcpy(vm->memory, snapshot.memory, sizeof(vm->memory));
+    start_loaded_image(vm);
+    memcpy(vm->pristine_registers, snapshot.registers, sizeof(vm->pristine_registers));
+    vm->pristine_registers[0] = 0;
+    vm->pristine_program_counter = snapshot.program_counter;
+    vm->pristine_heap = pristine_heap;
+    reset_virtual_machine(vm);
+
+    for (uint64_t skipped = 0; skipped < snapshot.input_position && peek_input(vm) >= 0; skipped++) {
+        vm->input.position++;
+    }
+    vm->input.mark = vm->input.position;
+    return 1;
+}
+
+// Lockstep execution
+//
+// VMs running the same image over different inputs execute together, eight
+// lanes at a time, while they agree on the program counter. Registers are
+// kept structure-of-arrays so an ALU instruction is one vector operation on
+// all lanes, AVX2 where the CPU has it. Loads and stores go lane by lane to
+// each VM's own memory. Virtual routines, heap accesses, sra and branches
+// the lanes disagree on run on the scalar interpreter instead, a block at a
+// time, and the lanes at the lowest program counter go first so that the
+// others can wait for them to catch up.
+#define LOCKSTEP_LANES 8
+
+// Runs a VM for about max_instructions, returns 0 once it halted or failed
+int run_lane(VirtualMachine* vm, int64_t max_instructions) {
+    uint8_t reason = resume_virtual_machine(vm, max_instructions);
+    return reason != STOP_HALTED && reason != STOP_ERROR;
+}
+
+#if defined(__GNUC__)
+typedef uint32_t LaneWords __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+
+struct lockstep_group {
+    VirtualMachine* vms[LOCKSTEP_LANES]; // lanes without a VM of their own repeat another
+    LaneWords registers[32];
+    unsigned int program_counter;
+    uint8_t handlers[256]; // with superinstructions split up again
+};
+typedef struct lockstep_group LockstepGroup;
+
+// Addresses of a plain load or store on every lane, 0 if any of them isn't
+// instruction or data memory (only data memory for stores)
+int get_lane_addresses(LockstepGroup* group, DecodedInstruction* instruction, int size, int store, unsigned int* addresses) {
+    uint8_t lowest = store ? PAGE_DATA : PAGE_INSTRUCTION;
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        addresses[lane] = group->registers[instruction->rs1][lane] + instruction->imm;
+        uint8_t kind = get_page_kind(group->vms[lane], addresses[lane], size);
+        if (kind < lowest || kind > PAGE_DATA) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 1 if every lane took a branch, 0 if none did, -1 if they disagree
+int get_lane_agreement(const LaneWords* taken) {
+    for (int lane = 1; lane < LOCKSTEP_LANES; lane++) {
+        if ((*taken)[lane] != (*taken)[0]) {
+            return -1;
+        }
+    }
+    return (*taken)[0] != 0;
+}
+
+// Runs all lanes from the group's program counter up to the first
+// instruction they can't run together, returns the instructions run
+#if defined(__x86_64__) && defined(__linux__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+int64_t run_lockstep_lanes(LockstepGroup* group) {
+    LaneWords* registers = group->registers;
+    LaneWords zero = {0};
+    int64_t executed = 0;
+
+    while (group->program_counter <= 1020) {
+        DecodedInstruction* instruction = &(group->vms[0]->decoded_instructions[group->program_counter / 4]);
+        LaneWords a = registers[instruction->rs1];
+        LaneWords b = registers[instruction->rs2];
+        uint32_t imm = (uint32_t) instruction->imm;
+        unsigned int addresses[LOCKSTEP_LANES];
+        unsigned int next = group->program_counter + 4;
+        uint8_t rd = instruction->rd;
+        uint8_t handler = group->handlers[group->program_counter / 4];
+        int size = 4;
+        LaneWords result = zero;
+
+        switch (handler) {
+            case HANDLER_ADD: result = a + b; break;
+            case HANDLER_SUB: result = a - b; break;
+            case HANDLER_XOR: result = a ^ b; break;
+            case HANDLER_OR: result = a | b; break;
+            case HANDLER_AND: result = a & b; break;
+            case HANDLER_SLL: result = a << (b & 31); break;
+            case HANDLER_SRL: result = a >> (b & 31); break;
+            case HANDLER_SLT: // comparisons have always been unsigned
+            case HANDLER_SLTU: result = (LaneWords) (a < b) & 1; break;
+            case HANDLER_ADDI: result = a + imm; break;
+            case HANDLER_XORI: result = a ^ imm; break;
+            case HANDLER_ORI: result = a | imm; break;
+            case HANDLER_ANDI: result = a & imm; break;
+            case HANDLER_SLTI:
+            case HANDLER_SLTIU: result = (LaneWords) (a < imm) & 1; break;
+            case HANDLER_LUI: result = zero + (imm << 12); break;
+            case HANDLER_LB:
+            case HANDLER_LBU:
+            case HANDLER_LH:
+            case HANDLER_LHU:
+            case HANDLER_LW:
+                size = handler == HANDLER_LB || handler == HANDLER_LBU ? 1 : handler == HANDLER_LW ? 4 : 2;
+                if (!get_lane_addresses(group, instruction, size, 0, addresses)) {
+                    return executed;
+                }
+                for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                    unsigned int value = 0;
+                    memcpy(&value, group->vms[lane]->memory + addresses[lane], size);
+                    if (handler == HANDLER_LB) {
+                        value = (unsigned int) (int8_t) value;
+                    } else if (handler == HANDLER_LH) {
+                        value = (unsigned int) (int16_t) value;
+                    }
+                    result[lane] = value;
+                }
+                break;
+            case HANDLER_SB:
+            case HANDLER_SH:
+            case HANDLER_SW:
+                size = handler == HANDLER_SB ? 1 : handler == HANDLER_SH ? 2 : 4;
+                if (!get_lane_addresses(group, instruction, size, 1, addresses)) {
+                    return executed;
+                }
+                for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                    uint32_t value = b[lane];
+                    memcpy(group->vms[lane]->memory + addresses[lane], &value, size);
+                    mark_dirty(group->vms[lane], addresses[lane], size);
+                }
+                rd = 0;
+                break;
+            case HANDLER_BEQ: result = (LaneWords) (a == b); break;
+            case HANDLER_BNE: result = (LaneWords) (a != b); break;
+            case HANDLER_BLT:
+            case HANDLER_BLTU: result = (LaneWords) (a < b); break;
+            case HANDLER_BGE:
+            case HANDLER_BGEU: result = (LaneWords) (a >= b); break;
+            case HANDLER_JAL:
+                result = zero + next;
+                next = group->program_counter + imm;
+                break;
+            case HANDLER_JALR:
+                result = (LaneWords) (a != a[0]);
+                if (get_lane_agreement(&result) != 0) {
+                    return executed;
+                }
+                result = zero + next;
+                next = a[0] + imm;
+                break;
+            default:
+                return executed;
+        }
+        if (handler >= HANDLER_BEQ && handler <= HANDLER_BGEU) {
+            int taken = get_lane_agreement(&result);
+            if (taken < 0) {
+                return executed;
+            }
+            next = taken ? group->program_counter + imm : next;
+            rd = 0;
+        }
+        if (rd != 0) {
+            registers[rd] = result;
+        }
+        group->program_counter = next;
+        executed++;
+    }
+    return executed;
+}
+#endif
+
+// Up to LOCKSTEP_LANES VMs that share an image, run until they all halted or
+// failed
+void run_lockstep_group(VirtualMachine** vms, int count) {
+    uint8_t running[LOCKSTEP_LANES];
+#if defined(__GNUC__)
+    LockstepGroup group;
+    int vectorized = 1;
+    for (int lane = 0; lane < count; lane++) {
+        vectorized &= memcmp(vms[lane]->memory, vms[0]->memory, 0x400) == 0
+            && vms[lane]->breakpoint < 0 && vms[lane]->coverage_map == NULL && vms[lane]->profile == NULL
+            && vms[lane]->stats == NULL && vms[lane]->trace == NULL;
+    }
+    for (int i = 0; i < 256; i++) {
+        group.handlers[i] = get_first_handler(vms[0]->decoded_instructions[i].handler);
+    }
+#endif
+    for (int lane = 0; lane < count; lane++) {
+        running[lane] = 1;
+    }
+
+    while (1) {
+        unsigned int lowest = UINT32_MAX;
+        int live = 0;
+        int at_lowest = 0;
+        int last = 0;
+        for (int lane = 0; lane < count; lane++) {
+            if (!running[lane]) {
+                continue;
+            }
+            unsigned int address = vms[lane]->program_counter;
+            at_lowest = address < lowest ? 0 : at_lowest;
+            lowest = address < lowest ? address : lowest;
+            at_lowest += address == lowest;
+            live++;
+            last = lane;
+        }
+        if (live == 0) {
+            return;
+        } else if (live == 1) {
+            while (run_lane(vms[last], 0)) {
+            }
+            return;
+        }
+
+#if defined(__GNUC__)
+        if (vectorized && at_lowest == live) {
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                group.vms[lane] = lane < count && running[lane] ? vms[lane] : vms[last];
+                for (int i = 0; i < 32; i++) {
+                    group.registers[i][lane] = group.vms[lane]->registers[i];
+                }
+            }
+            group.program_counter = lowest;
+            int64_t executed = run_lockstep_lanes(&group);
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                for (int i = 0; i < 32; i++) {
+                    group.vms[lane]->registers[i] = group.registers[i][lane];
+                }
+                group.vms[lane]->program_counter = group.program_counter;
+            }
+            if (executed > 0) {
+                continue;
+            }
+        }
+#endif
+        for (int lane = 0; lane < count; lane++) {
+            if (running[lane] && vms[lane]->program_counter == lowest) {
+                running[lane] = run_lane(vms[lane], 1);
+            }
+        }
+    }
+}
+
+// Embedding API, see riskxvii.h
+VirtualMachine* vm_create(void) {
+    VirtualMachine* vm = calloc(1, sizeof(VirtualMachine));
+    if (vm != NULL) {
+        init_virtual_machine(vm);
+    }
+    return vm;
+}
+
+void vm_destroy(VirtualMachine* vm) {
+    if (vm != NULL) {
+        destroy_virtual_machine(vm);
+        free(vm);
+    }
+}
+
+int vm_load_image(VirtualMachine* vm, const void* image, size_t size) {
+    if (size != sizeof(vm->memory)) {
+        return 0;
+    }
+    memcpy(vm->memory, image, size);
+    start_loaded_image(vm);
+    return 1;
+}
+
+int vm_load_image_file(VirtualMachine* vm, const char* path) {
+    if (!load_image(vm, path)) {
+        return 0;
+    }
+    start_loaded_image(vm);
+    return 1;
+}
+
+void vm_set_cache_directory(VirtualMachine* vm, const char* directory) {
+    vm->cache_directory = directory;
+}
+
+void vm_reset(VirtualMachine* vm) {
+    reset_virtual_machine(vm);
+}
+
+void vm_set_input_buffer(VirtualMachine* vm, const void* data, size_t length) {
+    close_input(vm);
+    vm->input.data = data;
+    vm->input.length = length;
+    vm->input.at_end = 1;
+}
+
+void vm_set_input(VirtualMachine* vm, FILE* stream, int nonblocking) {
+    close_input(vm);
+    open_input(vm, stream);
+    vm->input.nonblocking = nonblocking != 0;
+}
+
+void vm_set_output(VirtualMachine* vm, FILE* stream, size_t buffer_size, int nonblocking) {
+    flush_output(vm);
+    vm->output.stream = stream;
+    vm->output.nonblocking = nonblocking != 0;
+    vm->output.broken = 0;
+    set_output_buffer_size(vm, buffer_size);
+}
+
+size_t vm_flush_output(VirtualMachine* vm) {
+    flush_output(vm);
+    return vm->output.used;
+}
+
+int vm_set_jit(VirtualMachine* vm, int enabled) {
+#if defined(JIT_SUPPORTED)
+    vm->jit_enabled = enabled != 0 && vm->coverage_map == NULL && vm->profile == NULL && vm->stats == NULL
+        && vm->trace == NULL;
+#else
+    vm->jit_enabled = 0;
+#endif
+    return vm->jit_enabled;
+}
+
+void vm_set_routine_handler(VirtualMachine* vm, VirtualRoutineHandler handler, void* context) {
+    vm->routine_handler = handler;
+    vm->routine_context = context;
+}
+
+void vm_set_coverage_map(VirtualMachine* vm, uint8_t* map, size_t size) {
+    unsigned int mask = 0;
+    while (size / 2 > mask && mask < 0x7fffffff) {
+        mask = mask * 2 + 1;
+    }
+    vm->coverage_map = size > 0 ? map : NULL;
+    vm->coverage_mask = mask;
+    vm->coverage_previous = 0;
+    if (vm->coverage_map != NULL) {
+        vm->jit_enabled = 0;
+    }
+}
+
+int vm_set_profiling(VirtualMachine* vm, int enabled) {
+    if (!enabled) {
+        free_profile(vm->profile);
+        vm->profile = NULL;
+        return 1;
+    }
+    if (vm->profile == NULL) {
+        vm->profile = calloc(1, sizeof(Profile));
+        if (vm->profile == NULL) {
+            return 0;
+        }
+        vm->profile->branch = -1;
+    }
+    vm->jit_enabled = 0;
+    return 1;
+}
+
+int vm_set_stats(VirtualMachine* vm, FILE* out) {
+    if (out == NULL) {
+        free(vm->stats);
+        vm->stats = NULL;
+        return 1;
+    }
+    if (vm->stats == NULL) {
+        vm->stats = calloc(1, sizeof(RunStats));
+        if (vm->stats == NULL) {
+            return 0;
+        }
+    }
+    vm->stats->out = out;
+    vm->jit_enabled = 0;
+    return 1;
+}
+
+int vm_set_trace(VirtualMachine* vm, size_t entries) {
+    free_trace(vm->trace);
+    vm->trace = NULL;
+    if (entries == 0) {
+        return 1;
+    }
+    uint64_t size = 1;
+    while (size < entries) {
+        size *= 2;
+    }
+    Trace* trace = calloc(1, sizeof(Trace));
+    TraceEntry* ring = size <= SIZE_MAX / sizeof(TraceEntry) ? malloc(size * sizeof(TraceEntry)) : NULL;
+    if (trace == NULL || ring == NULL) {
+        free(trace);
+        free(ring);
+        return 0;
+    }
+    trace->entries = ring;
+    trace->mask = size - 1;
+    vm->trace = trace;
+    vm->jit_enabled = 0;
+    return 1;
+}
+
+int vm_write_trace(VirtualMachine* vm, const char* path) {
+    return write_trace(vm, path);
+}
+
+int vm_print_trace(const char* path, FILE* out) {
+    return print_trace(path, out);
+}
+
+int vm_set_call_graph(VirtualMachine* vm, int enabled) {
+    if (!enabled) {
+        if (vm->profile != NULL) {
+            vm->profile->call_graph = 0;
+        }
+        return 1;
+    }
+    return vm_set_profiling(vm, 1) && start_call_graph(vm);
+}
+
+int vm_load_symbols(VirtualMachine* vm, const char* path) {
+    return vm_set_profiling(vm, 1) && load_symbols(vm, path);
+}
+
+int vm_write_folded_stacks(VirtualMachine* vm, FILE* out) {
+    return write_folded_stacks(vm, out);
+}
+
+void vm_print_call_graph(VirtualMachine* vm) {
+    print_call_graph(vm);
+}
+
+int vm_run(VirtualMachine* vm, int64_t max_instructions) {
+    return resume_virtual_machine(vm, max_instructions);
+}
+
+void vm_run_lockstep(VirtualMachine** vms, int count) {
+    for (int first = 0; first < count; first += LOCKSTEP_LANES) {
+        run_lockstep_group(vms + first, count - first < LOCKSTEP_LANES ? count - first : LOCKSTEP_LANES);
+    }
+}
+
+void vm_stop(VirtualMachine* vm, int reason) {
+    stop_virtual_machine(vm, reason == STOP_HALTED ? STOP_HALTED : STOP_ERROR);
+}
+
+int vm_get_exit_status(VirtualMachine* vm) {
+    return vm->exit_status;
+}
+
+unsigned int vm_get_register(VirtualMachine* vm, int index) {
+    return index >= 0 && index < 32 ? vm->registers[index] : 0;
+}
+
+void vm_set_register(VirtualMachine* vm, int index, unsigned int value) {
+    if (index > 0 && index < 32) {
+        vm->registers[index] = value;
+    }
+}
+
+unsigned int vm_get_pc(VirtualMachine* vm) {
+    return vm->program_counter;
+}
+
+void vm_set_pc(VirtualMachine* vm, unsigned int address) {
+    vm->program_counter = address;
+}
+
+// Under the harts' lock, so no routine allocates or frees meanwhile
+int vm_read_memory(VirtualMachine* vm, unsigned int address, void* buffer, size_t length) {
+    lock_harts(vm);
+    uint8_t* bytes = length <= 0x10000 ? get_guest_range(vm, address, length, 0) : NULL;
+    if (bytes != NULL) {
+        memcpy(buffer, bytes, length);
+    }
+    unlock_harts(vm);
+    return bytes != NULL;
+}
+
+int vm_write_memory(VirtualMachine* vm, unsigned int address, const void* buffer, size_t length) {
+    lock_harts(vm);
+    uint8_t* bytes = length <= 0x10000 ? get_guest_range(vm, address, length, 1) : NULL;
+    if (bytes != NULL) {
+        memcpy(bytes, buffer, length);
+    }
+    unlock_harts(vm);
+    return bytes != NULL;
+}
+
+int vm_set_breakpoint(VirtualMachine* vm, unsigned int address) {
+    return set_breakpoint(vm, address);
+}
+
+void vm_clear_breakpoint(VirtualMachine* vm) {
+    clear_breakpoint(vm);
+}
+
+int vm_save_snapshot(VirtualMachine* vm, const char* path) {
+    return save_snapshot(vm, path);
+}
+
+int vm_restore_snapshot(VirtualMachine* vm, const char* path) {
+    return restore_snapshot(vm, path);
+}
+
+void vm_print_jit_stats(VirtualMachine* vm) {
+    print_jit_stats(vm);
+}
+
+void vm_print_profile(VirtualMachine* vm) {
+    print_profile(vm);
+}
+
+void vm_translate(VirtualMachine* vm, FILE* out, const char* image_path) {
+    emit_aot_translation(vm, out, image_path);
+}
@@ -0,0 +1,150 @@
+// libriskxvii: the RISK-XVII virtual machine as a library
+//
+// A host creates a VM, loads a 2 KiB image into it and runs it for as many
+// instructions at a time as it likes. vm_run() returns why it stopped and
+// the VM carries on from there on the next call. Guest console I/O goes to
+// stdio streams, and a routine handler lets the host take over any of the
+// virtual routines instead.
+#ifndef RISKXVII_H
+#define RISKXVII_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define RISKXVII_API __attribute__((visibility("default")))
+#else
+#define RISKXVII_API
+#endif
+
+typedef struct virtual_machine VirtualMachine;
+
+// Why vm_run() handed control back to the host
+enum stop_reason {
+    STOP_HALTED, // exit_status holds the guest's exit status
+    STOP_QUANTUM_EXPIRED, // resume to carry on
+    STOP_NEEDS_INPUT, // resume once the input is readable again
+    STOP_OUTPUT_FULL, // resume once the output stream takes more
+    STOP_ERROR, // illegal operation or unimplemented instruction, exit status 1
+    STOP_BREAKPOINT // at the breakpoint, before running its instruction
+};
+
+// Called for every access to a virtual routine (0x800 - 0x8ff) with its
+// number, (address - 0x800) / 4, before the built-in routine. Stores pass
+// the stored value in *value and loads return theirs in it. Returns 1 if
+// the access was handled, 0 to run the built-in routine.
+typedef int (*VirtualRoutineHandler)(VirtualMachine* vm, void* context, int routine, int is_store, unsigned int* value);
+
+// A new VM reads stdin and writes stdout, with the JIT off. NULL if out of
+// memory.
+RISKXVII_API VirtualMachine* vm_create(void);
+RISKXVII_API void vm_destroy(VirtualMachine* vm);
+
+// Loads an image of exactly 2048 bytes (instructions, then data) and resets
+// the registers, heap and program counter. Returns 0 if the size is wrong.
+RISKXVII_API int vm_load_image(VirtualMachine* vm, const void* image, size_t size);
+RISKXVII_API int vm_load_image_file(VirtualMachine* vm, const char* path);
+// Back to the state the image was loaded in, as a much cheaper reload.
+// Input and output carry on where they were.
+RISKXVII_API void vm_reset(VirtualMachine* vm);
+// Directory of .mic files that skip decoding on later loads, or NULL
+RISKXVII_API void vm_set_cache_directory(VirtualMachine* vm, const char* directory);
+
+// Streams belong to the caller. With nonblocking set, reads that would wait
+// return STOP_NEEDS_INPUT and output the stream can't take yet stays
+// buffered, returning STOP_OUTPUT_FULL once a whole buffer is pending.
+RISKXVII_API void vm_set_input(VirtualMachine* vm, FILE* stream, int nonblocking);
+// Input from memory the caller keeps until the next vm_set_input*() call,
+// with the end of input after it
+RISKXVII_API void vm_set_input_buffer(VirtualMachine* vm, const void* data, size_t length);
+RISKXVII_API void vm_set_output(VirtualMachine* vm, FILE* stream, size_t buffer_size, int nonblocking);
+// Writes out buffered output, returns the bytes still pending
+RISKXVII_API size_t vm_flush_output(VirtualMachine* vm);
+
+// Returns 1 if hot blocks will be compiled, 0 if interpreted or unsupported
+RISKXVII_API int vm_set_jit(VirtualMachine* vm, int enabled);
+RISKXVII_API void vm_set_routine_handler(VirtualMachine* vm, VirtualRoutineHandler handler, void* context);
+// AFL-style edge coverage: every branch and jump bumps a counter for its
+// (previous block, next block) pair in the map, which the caller keeps and
+// may share with a fuzzer. Only a power-of-two prefix of size bytes is used.
+// The JIT stays off while a map is set, NULL turns coverage off again.
+RISKXVII_API void vm_set_coverage_map(VirtualMachine* vm, uint8_t* map, size_t size);
+// Counts every instruction run by address and mnemonic, branch outcomes and
+// cycles spent in the virtual routines, with the JIT off. Counts add up over
+// runs and resets until profiling is turned off. Returns 0 if out of memory.
+RISKXVII_API int vm_set_profiling(VirtualMachine* vm, int enabled);
+// Adds a call graph to the profile, rooted at the current program counter.
+// jal or jalr writing ra is a call and jalr ra with rd = x0 a return. A
+// symbol map has an entry address in hex and a name per line, nm output
+// works too. Both turn profiling on and return 0 on error.
+RISKXVII_API int vm_set_call_graph(VirtualMachine* vm, int enabled);
+RISKXVII_API int vm_load_symbols(VirtualMachine* vm, const char* path);
+// Writes a line of JSON to out every time the program halts or fails, with
+// the instructions run, time and MIPS, loads and stores by memory region,
+// heap use and console bytes since the last one or vm_reset(). The JIT stays
+// off while it is set, NULL turns it off. Returns 0 if out of memory.
+RISKXVII_API int vm_set_stats(VirtualMachine* vm, FILE* out);
+// Keeps the address, encoding, rd value and memory address of the last
+// entries instructions run (rounded up to a power of two, 16 bytes each) in
+// a ring, with the JIT off. Fused instructions run unfused. 0 turns tracing
+// off. Returns 0 if out of memory.
+RISKXVII_API int vm_set_trace(VirtualMachine* vm, size_t entries);
+// Writes the ring to a trace file, oldest first, and renders one as text,
+// an instruction a line. Both return 0 on error.
+RISKXVII_API int vm_write_trace(VirtualMachine* vm, const char* path);
+RISKXVII_API int vm_print_trace(const char* path, FILE* out);
+
+// Runs for about max_instructions, or until it stops for another reason if
+// 0, and returns an enum stop_reason. Harts the program started with a store
+// to 0x844 run on threads of their own, also between calls, until the VM
+// halts, fails, is reset or destroyed. They need blocking streams: with a
+// non-blocking input or output none starts, and the program reads 0 in R[28]
+// as when no more harts could be started.
+RISKXVII_API int vm_run(VirtualMachine* vm, int64_t max_instructions);
+// Runs VMs loaded with the same image over different inputs until every
+// one has halted or failed, eight at a time. While they agree on the program
+// counter their ALU instructions run as vector operations across all of
+// them, everything else runs on each VM separately. Input and output streams
+// should be blocking.
+RISKXVII_API void vm_run_lockstep(VirtualMachine** vms, int count);
+// Ends the run with STOP_HALTED or STOP_ERROR, only from a routine handler
+RISKXVII_API void vm_stop(VirtualMachine* vm, int reason);
+RISKXVII_API int vm_get_exit_status(VirtualMachine* vm);
+
+// One breakpoint at a time, which stays until cleared. Returns 0 if the
+// address isn't an instruction.
+RISKXVII_API int vm_set_breakpoint(VirtualMachine* vm, unsigned int address);
+RISKXVII_API void vm_clear_breakpoint(VirtualMachine* vm);
+
+// Saves the state between two instructions (outside vm_run()) to a file.
+// Restoring makes it the state vm_reset() returns to, and skips as much of
+// the current input as the saved run had consumed. Both return 0 on error,
+// and saving fails while harts the program started are running.
+RISKXVII_API int vm_save_snapshot(VirtualMachine* vm, const char* path);
+RISKXVII_API int vm_restore_snapshot(VirtualMachine* vm, const char* path);
+
+RISKXVII_API unsigned int vm_get_register(VirtualMachine* vm, int index);
+RISKXVII_API void vm_set_register(VirtualMachine* vm, int index, unsigned int value);
+RISKXVII_API unsigned int vm_get_pc(VirtualMachine* vm);
+RISKXVII_API void vm_set_pc(VirtualMachine* vm, unsigned int address);
+
+// Copy length bytes of guest memory. Reads may cover instruction memory,
+// data memory and allocated heap banks, writes only the last two. Returns
+// 0 if any of the range isn't there. No virtual routine runs meanwhile, but
+// harts the program started go on with their own loads and stores.
+RISKXVII_API int vm_read_memory(VirtualMachine* vm, unsigned int address, void* buffer, size_t length);
+RISKXVII_API int vm_write_memory(VirtualMachine* vm, unsigned int address, const void* buffer, size_t length);
+
+// Per block JIT counters on stderr
+RISKXVII_API void vm_print_jit_stats(VirtualMachine* vm);
+// Profile report on stderr, hottest first
+RISKXVII_API void vm_print_profile(VirtualMachine* vm);
+// Inclusive and exclusive instructions by function on stderr, and every call
+// path as folded stacks ("main;f;g 1234") for flame graph tools
+RISKXVII_API void vm_print_call_graph(VirtualMachine* vm);
+RISKXVII_API int vm_write_folded_stacks(VirtualMachine* vm, FILE* out);
+// Writes the loaded image as a C program, see --aot
+RISKXVII_API void vm_translate(VirtualMachine* vm, FILE* out, const char* image_path);
+
+#endif
@@ -0,0 +1,83 @@
+// Runs a test image through libriskxvii in-process: short quanta, memory
+// and register access, a reset and a routine handler taking over printing.
+#include <stdio.h>
+#include <string.h>
+
+#include "riskxvii.h"
+
+#define IMAGE_PATH "test_cases/loops_and_calls.mi"
+
+int failures = 0;
+
+void check(int condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "api_test: %s\n", what);
+        failures++;
+    }
+}
+
+// Collects what the program prints with routine 1 (0x804) instead
+struct printed {
+    int values[8];
+    int count;
+};
+typedef struct printed Printed;
+
+int print_handler(VirtualMachine* vm, void* context, int routine, int is_store, unsigned int* value) {
+    Printed* printed = context;
+    (void) vm;
+    if (routine != 1 || !is_store || printed->count == 8) {
+        return 0;
+    }
+    printed->values[printed->count++] = (int) *value;
+    return 1;
+}
+
+int main(void) {
+    VirtualMachine* vm = vm_create();
+    FILE* output = tmpfile();
+    char text[256] = {0};
+    unsigned int word = 0;
+    int quanta = 0;
+    int reason;
+
+    if (vm == NULL || output == NULL || !vm_load_image_file(vm, IMAGE_PATH)) {
+        fprintf(stderr, "api_test: can't set up %s\n", IMAGE_PATH);
+        return 1;
+    }
+
+    // A short quantum hands control back many times before the halt
+    vm_set_input_buffer(vm, "100\n", 4);
+    vm_set_output(vm, output, 64, 0);
+    while ((reason = vm_run(vm, 100)) == STOP_QUANTUM_EXPIRED) {
+        quanta++;
+    }
+    check(reason == STOP_HALTED, "first run didn't halt");
+    check(quanta > 10, "first run didn't stop for its quantum");
+    check(vm_get_exit_status(vm) == 0, "first run exit status");
+    check(vm_get_register(vm, 9) == 5050, "s1 doesn't hold the sum");
+    check(vm_read_memory(vm, 0x400 + 36 * 4, &word, 4) && word == 100, "array word 36");
+    check(!vm_write_memory(vm, 0, &word, 4), "instruction memory was writable");
+    vm_flush_output(vm);
+    rewind(output);
+    check(fread(text, 1, sizeof(text) - 1, output) > 0, "no output");
+    check(strcmp(text, "5050\n4384\n5050\n-7\nCPU Halt Requested\n") == 0, "first run output");
+
+    // Again from the loaded state, compiled, with printing taken over
+    Printed printed = {{0}, 0};
+    vm_reset(vm);
+    vm_set_jit(vm, 1);
+    vm_set_input_buffer(vm, "10\n", 3);
+    vm_set_routine_handler(vm, print_handler, &printed);
+    check(vm_run(vm, 0) == STOP_HALTED, "second run didn't halt");
+    check(printed.count == 4, "second run printed count");
+    check(printed.values[0] == 55 && printed.values[1] == 55 && printed.values[2] == 55 && printed.values[3] == -7,
+          "second run printed values");
+
+    vm_destroy(vm);
+    fclose(output);
+    if (failures == 0) {
+        printf("api_test: ok\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+# Four jobs on two workers, one of them failing, with comments and blank
+# lines in the manifest
+vm=$1
+dir=$(mktemp -d)
+echo "3 4" > $dir/numbers.in
+cat > $dir/manifest <<MANIFEST
+# image input output
+examples/add_2_numbers/add_2_numbers.mi $dir/numbers.in $dir/add.out
+
+examples/hello_world/hello_world.mi - $dir/hello.out
+test_cases/heap_boundaries.mi - $dir/heap.out
+test_cases/subtract_2_numbers.mi test_cases/subtract_2_numbers.in $dir/subtract.out
+MANIFEST
+$vm --batch $dir/manifest --jobs 2 | sed "s|$dir/||"
+echo "exit ${PIPESTATUS[0]}"
+for output in add hello heap subtract; do
+    echo "$output:"
+    head -n 3 $dir/$output.out
+done
+rm -rf $dir
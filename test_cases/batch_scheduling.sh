@@ -0,0 +1,20 @@
+# Many more jobs than workers, sliced into tiny quanta, plus one job that
+# waits on a FIFO whose writer only shows up later
+vm=$1
+dir=$(mktemp -d)
+echo "3 4" > $dir/numbers.in
+mkfifo $dir/fifo
+echo "examples/add_2_numbers/add_2_numbers.mi $dir/fifo $dir/fifo.out" > $dir/manifest
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+    echo "examples/5_sum/5_sum.mi - $dir/sum$i.out" >> $dir/manifest
+    echo "examples/add_2_numbers_withfunc/add_2_numbers_withfunc.mi $dir/numbers.in $dir/add$i.out" >> $dir/manifest
+done
+(sleep 1; echo "30 40" > $dir/fifo) &
+$vm --batch $dir/manifest --jobs 3 --quantum 5 > $dir/report
+echo "exit $?"
+cut -d " " -f 3 $dir/report | uniq -c
+wait
+cat $dir/fifo.out
+cat $dir/sum*.out | sort | uniq -c
+cat $dir/add*.out | sort | uniq -c
+rm -rf $dir
@@ -0,0 +1,12 @@
+# main calls f three times, f calls g twice and main then sums to 5 with a
+# recursive function the symbol map doesn't name
+vm=$1
+dir=$(mktemp -d)
+$vm --call-graph $dir/folded.txt --symbols test_cases/nested_calls.map test_cases/nested_calls.mi
+echo "exit $?"
+cat $dir/folded.txt
+# Unnamed functions go by their address
+$vm --jit --call-graph $dir/folded.txt test_cases/nested_calls.mi > /dev/null 2>&1
+echo "exit $?"
+cat $dir/folded.txt
+rm -rf $dir
@@ -0,0 +1,58 @@
+// Edge coverage through the library: an input hits the same edges every
+// time it runs, and going round the loop more often adds hits, not edges
+#include <stdio.h>
+#include <string.h>
+
+#include "riskxvii.h"
+
+#define IMAGE_PATH "test_cases/running_sum.mi"
+#define MAP_SIZE 65536
+
+uint8_t map[MAP_SIZE];
+uint8_t previous[MAP_SIZE];
+
+// Runs the input from the loaded image with a cleared map and prints the
+// edges it hit and how often
+void run_input(VirtualMachine* vm, const char* input) {
+    int edges = 0;
+    int hits = 0;
+    memcpy(previous, map, MAP_SIZE);
+    memset(map, 0, MAP_SIZE);
+    vm_reset(vm);
+    vm_set_input_buffer(vm, input, strlen(input));
+    int reason = vm_run(vm, 0);
+    for (int i = 0; i < MAP_SIZE; i++) {
+        edges += map[i] != 0;
+        hits += map[i];
+    }
+    printf("%d numbers: stop reason %d, %d edges, %d hits, %s map\n", (int) (strlen(input) / 2), reason, edges, hits,
+           memcmp(map, previous, MAP_SIZE) == 0 ? "same" : "new");
+}
+
+int main(void) {
+    VirtualMachine* vm = vm_create();
+    FILE* output = tmpfile();
+    if (vm == NULL || output == NULL || !vm_load_image_file(vm, IMAGE_PATH)) {
+        fprintf(stderr, "coverage_test: can't set up %s\n", IMAGE_PATH);
+        return 1;
+    }
+    vm_set_output(vm, output, 4096, 0);
+    vm_set_coverage_map(vm, map, MAP_SIZE);
+
+    run_input(vm, "0\n");
+    run_input(vm, "5\n0\n");
+    run_input(vm, "5\n0\n");
+    run_input(vm, "5\n7\n9\n0\n");
+    // Compiled blocks would skip the counters, so the JIT stays off
+    vm_set_jit(vm, 1);
+    run_input(vm, "5\n7\n9\n0\n");
+
+    // Without a map nothing is counted
+    vm_set_coverage_map(vm, NULL, 0);
+    memset(map, 0, MAP_SIZE);
+    run_input(vm, "5\n0\n");
+
+    vm_destroy(vm);
+    fclose(output);
+    return 0;
+}
@@ -0,0 +1,22 @@
+# Without a fuzzer the image runs once. Under the protocol every command on
+# fd 198 runs the input in a child whose pid and wait status come back on
+# fd 199, with illegal operations aborting.
+vm=$1
+dir=$(mktemp -d)
+$vm --fork-server --input test_cases/running_sum.in test_cases/running_sum.mi
+echo "exit $?"
+# Prints the wait status of each child, after the handshake
+statuses() {
+    od -An -v -t u4 -w4 $dir/status | sed -n '3~2p' | while read status; do
+        echo "status $((status & 0x7f)) $((status >> 8))"
+    done
+}
+printf "1234" > $dir/commands
+$vm --fork-server --input test_cases/running_sum.in test_cases/running_sum.mi 198< $dir/commands 199> $dir/status > /dev/null
+echo "exit $?"
+statuses
+printf "12345678" > $dir/commands
+$vm --fork-server --input test_cases/running_sum.in test_cases/heap_boundaries.mi 198< $dir/commands 199> $dir/status > /dev/null
+echo "exit $?"
+statuses
+rm -rf $dir
@@ -0,0 +1,36 @@
+# A .mic file is written on the first run and used on later ones, while a
+# stale or damaged one is only a miss
+vm=$1
+dir=$(mktemp -d)
+image=test_cases/subtract_2_numbers.mi
+run() {
+    $vm --cache-dir $dir $image < test_cases/subtract_2_numbers.in
+    echo
+}
+run
+ls $dir | wc -l
+mic=$(ls $dir/*.mic)
+cp $mic $dir/good
+# Turning the decoded sub into an add shows the cached stream is what runs
+printf '\000' | dd of=$mic bs=1 seek=2096 conv=notrunc 2> /dev/null
+run
+# Another image's file under this image's name
+mkdir $dir/other
+$vm --cache-dir $dir/other test_cases/heap_boundaries.mi > /dev/null
+cp $dir/other/*.mic $mic
+run
+cmp -s $mic $dir/good && echo "rewritten"
+head -c 1000 $dir/good > $mic
+run
+cmp -s $mic $dir/good && echo "rewritten"
+# Records this build couldn't have written: an unknown handler and a block
+# running past the end of the image
+cp $dir/good $mic
+printf '\372' | dd of=$mic bs=1 seek=2096 conv=notrunc 2> /dev/null
+run
+cmp -s $mic $dir/good && echo "rewritten"
+cp $dir/good $mic
+printf '\377\377' | dd of=$mic bs=1 seek=4128 conv=notrunc 2> /dev/null
+run
+cmp -s $mic $dir/good && echo "rewritten"
+rm -rf $dir
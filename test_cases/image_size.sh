@@ -0,0 +1,15 @@
+# Images must be exactly 2048 bytes: short, long, empty and missing files
+# are all refused before anything runs
+vm=$(realpath $1)
+image=$(pwd)/test_cases/subtract_2_numbers.mi
+dir=$(mktemp -d)
+cd $dir
+head -c 100 $image > short.mi
+cat $image $image > long.mi
+: > empty.mi
+for file in short.mi long.mi empty.mi missing.mi; do
+    echo "3 4" | $vm $file
+    echo "exit $?"
+done
+cd - > /dev/null
+rm -rf $dir
@@ -0,0 +1,28 @@
+# Two clients at once on a server with a tiny output buffer and quantum,
+# the second half of their input arriving late, then a failing session
+vm=$1
+dir=$(mktemp -d)
+port=$((20000 + $$ % 20000))
+# Sends each argument as a line, half a second apart, and prints the reply
+client() {
+    timeout 20 bash -c "for i in 1 2 3 4 5 6 7 8 9 10; do exec 3<>/dev/tcp/127.0.0.1/$port && break; sleep 0.2; done 2>/dev/null
+        for line in $*; do printf '%s\n' \$line >&3; sleep 0.5; done; cat <&3"
+}
+
+$vm --listen $port --output-buffer 16 --quantum 50 test_cases/count_up.mi &
+server=$!
+client 300 -1 > $dir/first &
+first=$!
+client 20 -2 > $dir/second
+wait $first
+tail -n 3 $dir/first
+wc -l < $dir/first
+tail -n 3 $dir/second
+kill $server
+
+port=$((port + 1))
+$vm --listen $port test_cases/heap_boundaries.mi &
+server=$!
+client | grep -v "^R\["
+kill $server
+rm -rf $dir
@@ -0,0 +1,31 @@
+# Runs that agree, diverge and fail side by side, each giving the output it
+# would get on its own
+vm=$1
+dir=$(mktemp -d)
+printf "5\n7\n0\n" > $dir/a.in
+printf "5\n7\n0\n" > $dir/b.in
+printf "5\n-9\n3\n1\n0\n" > $dir/c.in
+printf "x\n" > $dir/d.in
+: > $dir/manifest
+for input in a b c d; do
+    echo "$dir/$input.in $dir/$input.out" >> $dir/manifest
+done
+echo "- $dir/none.out" >> $dir/manifest
+$vm --lockstep $dir/manifest test_cases/running_sum.mi
+echo "exit $?"
+for output in a b c d none; do
+    echo "$output:"
+    cat $dir/$output.out
+done
+printf "3\n8\n" > $dir/a.in
+printf "40\n-1\n" > $dir/b.in
+echo "$dir/a.in $dir/a.out" > $dir/manifest
+echo "$dir/b.in $dir/b.out" >> $dir/manifest
+$vm --lockstep $dir/manifest test_cases/count_up.mi
+echo "exit $?"
+cat $dir/a.out
+tail -n 3 $dir/b.out
+$vm --lockstep $dir/manifest test_cases/heap_boundaries.mi
+echo "exit $?"
+grep -h "Illegal" $dir/a.out $dir/b.out
+rm -rf $dir
@@ -0,0 +1,5 @@
+# A misspelled option is refused with the usage instead of being taken for
+# the image path
+vm=$1
+$vm --profle test_cases/subtract_2_numbers.mi < test_cases/subtract_2_numbers.in 2>&1 | head -n 1
+echo "exit ${PIPESTATUS[0]}"
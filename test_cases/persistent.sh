@@ -0,0 +1,10 @@
+# Every line is a run of its own: data, heap and stack written by one record
+# are back to their loaded state for the next, with and without the JIT
+vm=$1
+printf "3\n60\n\n2\n" | $vm --persistent test_cases/reset_state.mi
+echo "exit $?"
+printf "2\n2\n" | $vm --persistent --jit test_cases/reset_state.mi
+echo "exit $?"
+# A failing record doesn't stop the ones after it
+printf "\n\n" | $vm --persistent test_cases/heap_boundaries.mi | grep -v "^R\["
+echo "exit ${PIPESTATUS[1]}"
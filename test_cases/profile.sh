@@ -0,0 +1,11 @@
+# The report goes to stderr after the program's own output. Routine cycle
+# counts depend on the host, so only their call counts are compared.
+vm=$1
+dir=$(mktemp -d)
+for mode in --no-jit --jit; do
+    $vm --profile $mode test_cases/running_sum.mi < test_cases/running_sum.in 2> $dir/profile
+    echo "exit $?"
+    sed "/^virtual routines:/q" $dir/profile
+    sed "1,/^virtual routines:/d; s/ calls .*/ calls/" $dir/profile | sort
+done
+rm -rf $dir
@@ -0,0 +1,22 @@
+# Snapshots taken at an instruction count and at a program counter resume
+# where they were taken, skipping the input the first run had consumed
+vm=$(realpath $1)
+dir=$(mktemp -d)
+image=$(pwd)/test_cases/running_sum.mi
+input=$(pwd)/test_cases/running_sum.in
+harts=$(pwd)/test_cases/harts_atomics.mi
+cd $dir
+$vm --snapshot-at 40 --snapshot count.snap $image < $input > /dev/null
+$vm --restore count.snap < $input
+echo "exit $?"
+$vm --snapshot-at pc=0x14 --snapshot pc.snap $image < $input > /dev/null
+$vm --restore pc.snap < $input
+echo "exit $?"
+head -c 100 pc.snap > truncated.snap
+$vm --restore truncated.snap < $input
+echo "exit $?"
+# Other harts would go on changing memory the snapshot can't hold
+$vm --snapshot-at 40 --snapshot harts.snap $harts > /dev/null
+echo "exit $?"
+cd - > /dev/null
+rm -rf $dir
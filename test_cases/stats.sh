@@ -0,0 +1,11 @@
+# One JSON object per run on stderr. Timings vary from run to run, so they
+# are cut out before comparing.
+vm=$1
+timings='s/"seconds":[0-9.]*,"mips":[0-9.]*,//'
+for mode in --no-jit --jit; do
+    $vm --stats=json $mode test_cases/running_sum.mi < test_cases/running_sum.in 2>&1 > /dev/null | sed "$timings"
+done
+# A failing run, with the failed allocations along the way
+$vm --stats=json test_cases/heap_boundaries.mi 2>&1 > /dev/null | sed "$timings"
+# One object per record in persistent mode
+printf "3\n2\n" | $vm --persistent --stats=json test_cases/reset_state.mi 2>&1 > /dev/null | sed "$timings"
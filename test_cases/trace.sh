@@ -0,0 +1,19 @@
+# The ring keeps the last instructions, its size rounded up to a power of
+# two, whether the run halts or fails
+vm=$(realpath $1)
+image=$(pwd)/test_cases/call_graph.mi
+failing=$(pwd)/test_cases/heap_boundaries.mi
+dir=$(mktemp -d)
+cd $dir
+$vm --trace halt.trace --trace-size 12 $image
+echo "exit $?"
+$vm --print-trace halt.trace
+echo "exit $?"
+$vm --trace error.trace --trace-size 4 $failing | grep -v "^R\["
+$vm --print-trace error.trace
+echo "exit $?"
+head -c 50 halt.trace > truncated.trace
+$vm --print-trace truncated.trace > /dev/null
+echo "exit $?"
+cd - > /dev/null
+rm -rf $dir
@@ -1,1155 +1,1010 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <stdint.h>
-
-struct heap_memory {
-    uint8_t first_bank;
-	uint8_t banks_used;	
-	uint8_t next;
-	int value;
-	
-};
-typedef struct heap_memory HeapMemory;
-
-struct virtual_machine {
-    unsigned int program_counter;
-    unsigned int registers[32];
-
-    //Memory types
-    int instruction_memory[256]; // 0x000-0x3ff
-    int data_memory[256]; // 0x400-0x7ff
-    //virtual routines 0x800 - 0x8ff
-	HeapMemory heap_banks[128];
-};
-typedef struct virtual_machine VirtualMachine;
-
-struct instruction {
-    char binary[33];
-    uint8_t opcode;
-    char type[3];
-};
-typedef struct instruction Instruction;
-
-void get_instruction_type(Instruction* instruction) {
-	uint8_t opcode = instruction->opcode;
-	
-	switch (opcode) {
-		case 0b0110011:
-			strcpy(instruction->type, "R");
-			break;
-		case 0b0010011:
-		case 0b0000011:
-		case 0b1100111:
-			strcpy(instruction->type, "I");
-			break;
-		case 0b0100011:
-			strcpy(instruction->type, "S");
-			break;
-		case 0b1100011:
-			strcpy(instruction->type, "SB");
-			break;
-		case 0b0110111:
-			strcpy(instruction->type, "U");
-			break;
-		case 0b1101111:
-			strcpy(instruction->type, "UJ");
-			break;
-		default:
-			strcpy(instruction->type, "XX");
-			break;
-	}
-}
-
-// Error handling
-void register_dump(VirtualMachine* vm) {
-    printf("PC = 0x%08x;\n", vm->program_counter);
-    for (int i = 0; i < 32; i++) {
-        printf("R[%d] = 0x%08x;\n", i, (unsigned int) vm->registers[i]);
-    }
-}
-
-void fake_instruction(VirtualMachine* vm, int num) {
-    printf("Instruction Not Implemented: 0x%08x\n", (unsigned int) num);
-    register_dump(vm);
-}
-
-void illegal_operation(VirtualMachine* vm) {
-	unsigned int current_instruction = (unsigned int) (vm->program_counter / 4);
-    printf("Illegal Operation: 0x%08x\n", vm->instruction_memory[current_instruction]);
-    register_dump(vm);
-	exit(1);
-}
-
-// Heap banks
-int get_next_allocation(VirtualMachine* vm, uint8_t start_index) {
-	for (int i = start_index; i < 128; i++) {
-		HeapMemory* memory_item = &(vm->heap_banks[i]);
-		if (memory_item->first_bank != 255) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-void fix_previous_allocations(VirtualMachine* vm, uint8_t start_index, uint8_t check_next, uint8_t new_next) {
-	for (int i = start_index; i >= 0; i--) {
-		HeapMemory* memory_item = &(vm->heap_banks[i]);
-		if (memory_item->first_bank != 255) {
-			if (memory_item->next == check_next) {
-				memory_item->next = new_next;
-			}
-		}
-	}
-}
-
-void my_malloc(VirtualMachine* vm, int size) {
-    uint8_t success = 0;
-    uint8_t banks_required = (uint8_t) (size / 64);
-	uint8_t remainder = size % 64;
-	
-	if (remainder > 0) {
-		banks_required++;
-	}
-	
-    if (banks_required == 0 || banks_required > 128) {
-        vm->registers[28] = 0;
-        return;
-    }	
-
-    uint8_t free_banks = 0;
-    short first_bank = -1;
-
-    for (int i = 0; i < 128; i++) {
-		HeapMemory* memory_item = &(vm->heap_banks[i]);
-        if (memory_item->first_bank == 255) {
-            if (first_bank == -1) {
-                first_bank = i;
-            }
-            free_banks++;
-            if (free_banks == banks_required) {
-                success = 1;
-				
-				for (int i = first_bank; i < (first_bank + banks_required); i++) {
-					HeapMemory* iterated_memory_item = &(vm->heap_banks[i]);
-					iterated_memory_item->first_bank = first_bank;
-					iterated_memory_item->banks_used = banks_required;
-					iterated_memory_item->value = 0;
-					iterated_memory_item->next = get_next_allocation(vm, first_bank + banks_required);
-				}
-				fix_previous_allocations(vm, first_bank-1, memory_item->next, first_bank);
-				
-                break;
-            }
-        } else {
-            first_bank = -1;
-            free_banks = 0;
+#include "riskxvii.h"
+
+// Command line front end to libriskxvii
+
+// --batch runs jobs on a pool of POSIX threads
+#if defined(__unix__)
+#define BATCH_THREADS
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// --listen multiplexes sessions on one thread with epoll
+#if defined(__linux__)
+#define EVENT_LOOP
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#endif
+
+// --fork-server speaks AFL's fork server protocol
+#if defined(__unix__)
+#define FORK_SERVER
+#include <sys/shm.h>
+#include <sys/wait.h>
+#endif
+
+#define OUTPUT_BUFFER_SIZE 65536
+#define TRACE_SIZE (1 << 20) // instructions kept by --trace
+
+// Runs until the program halts or fails and returns its exit status
+int run_to_completion(VirtualMachine* vm) {
+    int reason;
+    do {
+        reason = vm_run(vm, 0);
+    } while (reason != STOP_HALTED && reason != STOP_ERROR);
+    return vm_get_exit_status(vm);
+}
+
+// Call graph table on stderr and its folded stacks to path, 0 on error
+int write_call_graph(VirtualMachine* vm, const char* path) {
+    vm_print_call_graph(vm);
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return 0;
+    }
+    int written = vm_write_folded_stacks(vm, out);
+    return fclose(out) == 0 && written;
+}
+
+// Snapshots
+//
+// --snapshot-at runs the program to an instruction count, reached at the
+// first block boundary past it, or until it is about to run the instruction
+// at pc=<address>. The VM is saved there and the run carries on. Returns the
+// stop reason, or -1 if the snapshot couldn't be taken.
+int run_to_snapshot(VirtualMachine* vm, const char* point, const char* path) {
+    int reason = STOP_QUANTUM_EXPIRED;
+    if (strncmp(point, "pc=", 3) == 0) {
+        if (!vm_set_breakpoint(vm, strtoul(point + 3, NULL, 0))) {
+            fprintf(stderr, "%s is not an instruction address\n", point + 3);
+            return -1;
         }
+        reason = vm_run(vm, 0);
+        vm_clear_breakpoint(vm);
+    } else if (strtoll(point, NULL, 0) > 0) {
+        reason = vm_run(vm, strtoll(point, NULL, 0));
+    }
+    if (reason == STOP_HALTED || reason == STOP_ERROR) {
+        fprintf(stderr, "program stopped before %s, no snapshot taken\n", point);
+        return reason;
+    }
+    return vm_save_snapshot(vm, path) ? reason : -1;
+}
+
+// Persistent mode
+//
+// Runs the image once per line of input, that line being all the input the
+// run sees, and resets the VM in between instead of loading it again.
+// Returns 1 if any record failed.
+int run_records(VirtualMachine* vm, FILE* input) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int failed = 0;
+
+    while ((length = getline(&line, &capacity, input)) > 0) {
+        vm_set_input_buffer(vm, line, length);
+        failed |= run_to_completion(vm) != 0;
+        vm_reset(vm);
+    }
+    free(line);
+    return failed;
+}
+
+// Fork server
+//
+// Under afl-fuzz the image is loaded and decoded once and every test input
+// runs in a fork of this process, with the edge coverage going straight into
+// the fuzzer's shared memory map. Illegal operations abort() there so the
+// fuzzer files them as crashes. Without a fuzzer on the other end of the
+// control pipes the image runs once as usual.
+#if defined(FORK_SERVER)
+#define FORK_SERVER_CONTROL_FD 198 // the status pipe is the next descriptor
+#define COVERAGE_MAP_SIZE 65536
+
+int run_test_input(VirtualMachine* vm, const char* input_path, int abort_on_error) {
+    FILE* input = input_path != NULL ? fopen(input_path, "rb") : stdin;
+    if (input == NULL) {
+        perror("error opening input file");
+        return 1;
     }
-
-    if (success == 1) {
-        vm->registers[28] = first_bank * 64 + 0xb700;
-    } else {
-        vm->registers[28] = 0;
-    }
-}
-
-void error_check_heap_bank(VirtualMachine* vm, int address) {		
-	if (address < 0xb700 || address > 0xd700) {
-        illegal_operation(vm);
-	}
-	
-    if (address % 64 != 0) { // not start of bank
-        illegal_operation(vm);
-    }
-    
-	int bank_index = (address - 0xb700) / 64;	
-	HeapMemory* memory_item = &(vm->heap_banks[bank_index]);
-	
-	if (memory_item->first_bank == 255) {
-		illegal_operation(vm); // not allocated
-	}
-}
-
-void my_free(VirtualMachine* vm, int address) {
-	error_check_heap_bank(vm, address);
-	
-	int bank_index = (address - 0xb700) / 64;
-	HeapMemory* memory_item = &(vm->heap_banks[bank_index]);
-	
-	for (int i = bank_index; i >= 0; i--) {
-		HeapMemory* iterated_memory_item = &(vm->heap_banks[i]);
-		if (iterated_memory_item->first_bank != 255) {
-			HeapMemory* prev_alloc = &(vm->heap_banks[i]);
-			if (prev_alloc->next == iterated_memory_item->first_bank) {
-				prev_alloc->next = memory_item->next;
-			}
-			break;
-		}
-	}
-	
-	for (int i = bank_index; i < 128; i++) {
-		HeapMemory* iterated_memory_item = &(vm->heap_banks[i]);
-		if (iterated_memory_item->first_bank == memory_item->first_bank) {
-			iterated_memory_item->first_bank = 255;
-		}
-	}
-}
-
-int get_bank_value(VirtualMachine* vm, int address) {
-	error_check_heap_bank(vm, address);
-	
-	int bank_index = (address - 0xb700) / 64;
-	HeapMemory* memory_item = &(vm->heap_banks[bank_index]);
-	
-	return memory_item->value;
-}
-
-void set_bank_value(VirtualMachine* vm, int address, long val) {
-	error_check_heap_bank(vm, address);
-	
-	int bank_index = (address - 0xb700) / 64;
-	HeapMemory* memory_item = &(vm->heap_banks[bank_index]);
-		
-	memory_item->value = val;
-}
-
-// Virtual routines
-int check_virtual_routine(VirtualMachine* vm, int vr_id, uint8_t register_index) {
-	if (vr_id == 0) {
-        printf("%c", vm->registers[register_index]);
-    } else if (vr_id == 1) {
-        printf("%d", vm->registers[register_index]);
-    } else if (vr_id == 2) {
-        printf("%x", (unsigned int) vm->registers[register_index]);
-    } else if (vr_id == 3) {
-        printf("CPU Halt Requested\n");
-        exit(0);
-    } else if (vr_id == 4) {
-        char c;
-        int n = scanf("%c\n", &c);
-		if (n > 0) {
-			vm->registers[register_index] = (unsigned int) c;
-		}        
-    } else if (vr_id == 5) {
-        int num;
-        int n = scanf("%d", &num);
-		if (n > 0) {
-			vm->registers[register_index] = (unsigned int) num;
-		}        
-    } else if (vr_id == 6) {
-        printf("%x", vm->program_counter);
-    } else if (vr_id == 7) {
-        register_dump(vm);
-    } else if (vr_id == 8) {
-        printf("%x", (unsigned int) vm->registers[register_index]);
-    }
-	return 0;
-}
-
-// Convert from binary to decimal
-int binary_to_decimal(char* binary) {
-    int decimal = 0;
-    for (int i = 0; i < strlen(binary); i++) {
-        if (binary[i] == '1') {
-            decimal += pow(2, (strlen(binary)-1)-i);
+    vm_set_input(vm, input, 0);
+    int reason;
+    do {
+        reason = vm_run(vm, 0);
+    } while (reason != STOP_HALTED && reason != STOP_ERROR);
+    vm_flush_output(vm);
+    if (reason == STOP_ERROR && abort_on_error) {
+        abort();
+    }
+    return vm_get_exit_status(vm);
+}
+
+int run_fork_server(VirtualMachine* vm, const char* input_path) {
+    const char* shm_id = getenv("__AFL_SHM_ID");
+    if (shm_id != NULL) {
+        uint8_t* map = shmat(atoi(shm_id), NULL, 0);
+        if (map == (void*) -1) {
+            perror("shmat");
+            return 1;
+        }
+        const char* map_size = getenv("AFL_MAP_SIZE");
+        vm_set_coverage_map(vm, map, map_size != NULL ? strtoul(map_size, NULL, 0) : COVERAGE_MAP_SIZE);
+    }
+
+    uint32_t message = 0;
+    if (write(FORK_SERVER_CONTROL_FD + 1, &message, 4) != 4) {
+        return run_test_input(vm, input_path, 0);
+    }
+    while (read(FORK_SERVER_CONTROL_FD, &message, 4) == 4) {
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+            return 1;
+        } else if (child == 0) {
+            close(FORK_SERVER_CONTROL_FD);
+            close(FORK_SERVER_CONTROL_FD + 1);
+            exit(run_test_input(vm, input_path, 1));
+        }
+        int status;
+        if (write(FORK_SERVER_CONTROL_FD + 1, &child, 4) != 4 || waitpid(child, &status, 0) < 0
+                || write(FORK_SERVER_CONTROL_FD + 1, &status, 4) != 4) {
+            return 1;
         }
     }
-    return decimal;
+    return 0;
 }
+#endif
 
-// Convert instruction from uint to binary string
-void decimal_to_binary(char* binary, unsigned int num) {
-    binary[32] = '\0';
-    for (int i = 31; i >= 0; i--) {
-        if (num >= pow(2,i)) {
-            num -= pow(2,i);
-            binary[31-i] = '1';
-        } else {
-            binary[31-i] = '0';
+// Lockstep mode
+//
+// Runs the image once per manifest line, "<input> <output>" with "-" for no
+// input, through vm_run_lockstep() so that runs taking the same path through
+// the program share their ALU work. Returns 1 if any run failed.
+#define LOCKSTEP_CHUNK 64 // runs loaded at a time
+
+struct lockstep_run {
+    VirtualMachine* vm;
+    FILE* input;
+    FILE* output;
+};
+typedef struct lockstep_run LockstepRun;
+
+// Returns 1 if any of the runs failed
+int finish_lockstep_runs(LockstepRun* runs, int count) {
+    VirtualMachine* vms[LOCKSTEP_CHUNK];
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        vms[i] = runs[i].vm;
+    }
+    vm_run_lockstep(vms, count);
+    for (int i = 0; i < count; i++) {
+        failed |= vm_get_exit_status(runs[i].vm) != 0;
+        vm_destroy(runs[i].vm);
+        if (runs[i].input != NULL) {
+            fclose(runs[i].input);
         }
+        failed |= fclose(runs[i].output) != 0;
     }
+    return failed;
 }
 
-// Store binary substring into dest (component binary)
-void assign_format_binary(char* binary, int offset, char* dest, int dest_size) {
-    for (int i = 0; i < dest_size - 1; i++) {
-        dest[i] = binary[i + offset];
-    }
-    dest[dest_size - 1] = '\0';
-}
+int run_lockstep(const char* manifest_path, const char* image_path, int jit_enabled, size_t output_buffer_size, const char* cache_directory) {
+    FILE* manifest = fopen(manifest_path, "r");
+    LockstepRun runs[LOCKSTEP_CHUNK];
+    char line[2 * 4096];
+    int count = 0;
+    int failed = 0;
 
-char convert_twos_complement(char* binary) {
-    if (binary[0] == '0') {
-        return '+';
+    if (manifest == NULL) {
+        perror("error opening manifest");
+        return 1;
     }
-	
-    int count = 0;
-    for (int i = 0; binary[i] != '\0'; i++) {
-        count++;
-        if (binary[i] == '0') {
-            binary[i] = '1';
-        }  else if (binary[i] == '1') {
-            binary[i] = '0';
+    for (int line_number = 1; fgets(line, sizeof(line), manifest) != NULL; line_number++) {
+        char* input_path = strtok(line, " \t\r\n");
+        char* output_path = strtok(NULL, " \t\r\n");
+        if (input_path == NULL || input_path[0] == '#') {
+            continue;
         }
-    }
-	
-    for (int i = count - 1; i >= 0; i--) {
-        if (binary[i] == '0') {
-            binary[i] = '1';
+        if (output_path == NULL) {
+            fprintf(stderr, "%s:%d: expected <input> <output>\n", manifest_path, line_number);
+            failed = 1;
             break;
-        } else if (binary[i] == '1') {
-            binary[i] = '0';
         }
-    }
-    return '-';
-}
-
-// Bit manipulation
-int sext(int last_bits) {
-    if ((last_bits & 0x80) == 0x80) {
-        return last_bits | 0xFFFFFF00;
-    } else {
-        return last_bits | 0x00;
-    }
-}
-
-int bit8_shift(int remainder, int num) {
-    if (remainder == 0) {
-        num = num & 0xFF;
-    } else if (remainder == 1) {
-        num = num & 0xFF00;
-        num = num >> 8;
-    } else if (remainder == 2) {
-        num = num & 0xFF0000;
-        num = num >> 16;
-    }  else {
-        num = num & 0xFF000000;
-        num = num >> 24;
-    }
-    return num;
-}
-
-int bit16_shift(int remainder, int num, int nextNum) {
-    if (remainder == 0) {
-        num = (num & 0xFF << 8) | ((nextNum & 0xFF000000) >> 24);
-    } else if (remainder == 1) {
-        num = num & 0xFFFF;
-        num = num >> 8;
-    } else if (remainder == 2) {
-        num = num & 0xFFFF00;
-        num = num >> 8;
-    }  else {
-        num = num & 0xFFFF0000;
-        num = num >> 16;
-    }
-    return num;
-}
-
-int bit32_shift(int remainder, int num, int nextNum) {
-    if (remainder == 0) {
-        num = ((num & 0xFF) << 24) | ((nextNum & 0xFFFFFF00) >> 8);
-    } else if (remainder == 1) {
-        num = ((num & 0xFFFF) << 16) | ((nextNum & 0xFFFF0000) >> 16);
-    } else if (remainder == 2) {
-        num = ((num & 0xFFFFFF) << 8) | ((nextNum & 0xFF000000) >> 24);
-    }  else {
-        num = num & 0xFFFFFFFF;
-    }
-    return num;
-}
-
-int bit8_store(int remainder, int num, int new_value) {
-    if (remainder == 0) {
-        num = (num & 0xFFFFFF00) | (new_value & 0xFF);
-    } else if (remainder == 1) {
-        num = (num & 0xFFFF00FF) | (new_value & 0xFF00);
-    } else if (remainder == 2) {
-        num = (num & 0xFF00FFFF) | (new_value & 0xFF0000);
-    }  else {
-        num = (num & 0x00FFFFFF) | (new_value & 0xFF000000);
-    }
-    return num;
-}
-
-void bit16_store(int remainder, int num1, int num2, int new_value, int* value1, int* value2) {
-    if (remainder == 0) {
-        *value1 = (num1 & 0xFFFFFF00) | ((new_value & 0xFF00) >> 8);
-		*value2 = (num2 & 0x00FFFFFF) | ((new_value & 0x00FF) << 24);
-    } else if (remainder == 1) {
-        *value1 = (num1 & 0xFFFF0000) | (new_value & 0xFFFF);
-    } else if (remainder == 2) {
-        *value1 = (num1 & 0xFF0000FF) | ((new_value & 0xFFFF) << 8);
-    }  else {
-        *value1 = (num1 & 0xFFFF) | ((new_value & 0xFFFF) << 16);
-    }
-}
-
-void bit32_store(int remainder, int num1, int num2, int new_value, int* value1, int* value2) {
-    if (remainder == 0) {
-        *value1 = (num1 & 0xFFFFFF00) | ((new_value & 0xFF000000) >> 24);
-		*value2 = (num2 & 0x000000FF) | ((new_value & 0x00FFFFFF) << 8);
-    } else if (remainder == 1) {
-        *value1 = (num1 & 0xFFFF0000) | ((new_value & 0xFFFF0000) >> 16);
-		*value2 = (num2 & 0x0000FFFF) | ((new_value & 0x0000FFFF) << 16);
-    } else if (remainder == 2) {
-        *value1 = (num1 & 0xFF000000) | ((new_value & 0x00FFFFFF) >> 8);
-		*value2 = (num2 & 0x00FFFFFF) | ((new_value & 0x000000FF) << 24);
-    }  else {
-        *value1 = num1 | new_value;
-    }
-}
 
-int get_next_num(VirtualMachine* vm, int address) {
-    if (address >= 0 && address <= 1023) {
-        if (address >= 1021) {
-            return vm->data_memory[0];
+        LockstepRun* run = &(runs[count]);
+        run->vm = vm_create();
+        run->input = strcmp(input_path, "-") == 0 ? NULL : fopen(input_path, "rb");
+        run->output = fopen(output_path, "wb");
+        if (run->vm == NULL || (run->input == NULL && strcmp(input_path, "-") != 0) || run->output == NULL) {
+            perror(run->vm == NULL ? image_path : run->output == NULL ? output_path : input_path);
+        } else {
+            vm_set_cache_directory(run->vm, cache_directory);
+            if (vm_load_image_file(run->vm, image_path)) {
+                vm_set_input(run->vm, run->input, 0);
+                vm_set_output(run->vm, run->output, output_buffer_size, 0);
+                vm_set_jit(run->vm, jit_enabled);
+                if (++count == LOCKSTEP_CHUNK) {
+                    failed |= finish_lockstep_runs(runs, count);
+                    count = 0;
+                }
+                continue;
+            }
         }
-        return vm->instruction_memory[address / 4 + 1];
-    } else if (address >= 1024 && address <= 2047) {
-        if (address >= 2045) {
-            return 0;
+        failed = 1;
+        vm_destroy(run->vm);
+        if (run->input != NULL) {
+            fclose(run->input);
+        }
+        if (run->output != NULL) {
+            fclose(run->output);
         }
-        return vm->data_memory[(address - 1024) / 4 + 1];
-    }
-	return 0;
-}
-
-// Arithmetic and logic operations
-void add(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] + vm->registers[rs2];
-    }    
-}
-
-void addi(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] + imm;
     }
-}
+    fclose(manifest);
+    return finish_lockstep_runs(runs, count) | failed;
+}
+
+// Batch mode
+//
+// Each manifest line names an image, an input file ("-" for none) and an
+// output file, and every job runs in its own VirtualMachine. Jobs are time
+// sliced: a worker runs the job at the front of its own queue for one
+// quantum of instructions and requeues it at the back, and a worker whose
+// queue is empty steals from the back of the others. A job waiting on a pipe
+// or FIFO with nothing to read is parked instead of blocking its worker and
+// queued again once poll() reports the input readable. The exit status of
+// every job is reported once all of them have finished.
+#if defined(BATCH_THREADS)
+#define BATCH_QUANTUM 100000
+#define BATCH_POLL_INTERVAL 64 // quanta between checks on parked jobs
+
+struct batch_job {
+    char* image_path;
+    char* input_path;
+    char* output_path;
+    int status;
+    VirtualMachine* vm; // while the job is running
+    FILE* input;
+    FILE* output;
+};
+typedef struct batch_job BatchJob;
+
+// Ring buffer with room for every job
+struct job_queue {
+    pthread_mutex_t lock;
+    BatchJob** jobs;
+    int capacity;
+    int front;
+    int count;
+};
+typedef struct job_queue JobQueue;
+
+struct batch_runner {
+    BatchJob* jobs;
+    int job_count;
+    JobQueue* queues;
+    int worker_count;
+    int64_t quantum;
+    uint8_t jit_enabled;
+    size_t output_buffer_size;
+    const char* cache_directory;
+
+    // Parked jobs and the number of unfinished jobs
+    pthread_mutex_t lock;
+    BatchJob** parked;
+    int parked_count;
+    int remaining;
+
+    // Only one worker polls the parked jobs at a time
+    pthread_mutex_t poll_lock;
+    struct pollfd* poll_fds;
+    BatchJob** polled;
+};
+typedef struct batch_runner BatchRunner;
 
-void sub(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] - vm->registers[rs2];
+struct batch_worker {
+    BatchRunner* runner;
+    int index;
+    pthread_t thread;
+};
+typedef struct batch_worker BatchWorker;
+
+void push_job(JobQueue* queue, BatchJob* job) {
+    pthread_mutex_lock(&(queue->lock));
+    queue->jobs[(queue->front + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_mutex_unlock(&(queue->lock));
+}
+
+BatchJob* take_job(JobQueue* queue, int from_back) {
+    BatchJob* job = NULL;
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->count > 0) {
+        queue->count--;
+        if (from_back) {
+            job = queue->jobs[(queue->front + queue->count) % queue->capacity];
+        } else {
+            job = queue->jobs[queue->front];
+            queue->front = (queue->front + 1) % queue->capacity;
+        }
     }
+    pthread_mutex_unlock(&(queue->lock));
+    return job;
 }
 
-void lui(VirtualMachine* vm, uint8_t rd, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = imm * pow(2,12);
+// Returns 0 and sets the job's status if it can't be started
+int start_batch_job(BatchRunner* runner, BatchJob* job) {
+    job->vm = vm_create();
+    if (job->vm == NULL) {
+        fprintf(stderr, "%s: out of memory\n", job->image_path);
+        return 0;
     }
-}
-
-void xor(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] ^ vm->registers[rs2];
+    // Opening a FIFO without O_NONBLOCK would wait for a writer
+    if (strcmp(job->input_path, "-") != 0) {
+        int fd = open(job->input_path, O_RDONLY | O_NONBLOCK);
+        if (fd < 0 || (job->input = fdopen(fd, "rb")) == NULL) {
+            perror(job->input_path);
+            return 0;
+        }
     }
-}
-
-void xori(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] ^ imm;
+    if ((job->output = fopen(job->output_path, "wb")) == NULL) {
+        perror(job->output_path);
+        return 0;
     }
-}
-
-void or(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] | vm->registers[rs2];
+    vm_set_cache_directory(job->vm, runner->cache_directory);
+    if (!vm_load_image_file(job->vm, job->image_path)) {
+        return 0;
     }
+    vm_set_input(job->vm, job->input, 1);
+    vm_set_output(job->vm, job->output, runner->output_buffer_size, 0);
+    vm_set_jit(job->vm, runner->jit_enabled);
+    return 1;
 }
 
-void ori(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] | imm;
+void finish_batch_job(BatchRunner* runner, BatchJob* job) {
+    vm_destroy(job->vm);
+    job->vm = NULL;
+    if (job->input != NULL) {
+        fclose(job->input);
     }
-}
-
-void and(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] & vm->registers[rs2];
+    if (job->output != NULL && fclose(job->output) != 0) {
+        job->status = 1;
     }
+    pthread_mutex_lock(&(runner->lock));
+    runner->remaining--;
+    pthread_mutex_unlock(&(runner->lock));
 }
 
-void andi(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->registers[rs1] & imm;
+void run_batch_quantum(BatchRunner* runner, BatchJob* job, JobQueue* queue) {
+    if (job->vm == NULL && !start_batch_job(runner, job)) {
+        job->status = 1;
+        finish_batch_job(runner, job);
+        return;
     }
-}
-
-void sll(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-	//printf("sll (%d) ", vm->program_counter); 
-    if (rd != 0) {
-        vm->registers[rd] =  vm->registers[rs1] << vm->registers[rs2];
+    int reason = vm_run(job->vm, runner->quantum);
+    if (reason == STOP_HALTED || reason == STOP_ERROR) {
+        job->status = vm_get_exit_status(job->vm);
+        finish_batch_job(runner, job);
+    } else if (reason == STOP_NEEDS_INPUT) {
+        pthread_mutex_lock(&(runner->lock));
+        runner->parked[runner->parked_count++] = job;
+        pthread_mutex_unlock(&(runner->lock));
+    } else {
+        push_job(queue, job);
     }
 }
 
-void srl(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] =  vm->registers[rs1] >> vm->registers[rs2];
+// Moves parked jobs whose input became readable to the worker's queue,
+// waiting up to timeout milliseconds for one
+void unpark_jobs(BatchRunner* runner, JobQueue* queue, int timeout) {
+    if (pthread_mutex_trylock(&(runner->poll_lock)) != 0) {
+        poll(NULL, 0, timeout);
+        return;
     }
-}
-
-void sra(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    int value = vm->registers[rs1];
-    for (int i = 0; i < vm->registers[rs2]; i++) {
-        if ((value & 0b01) > 0) {
-            value = value >> 1;
-            value = value | 0b10000000;
-        } else {
-            value = value >> 1;
+    pthread_mutex_lock(&(runner->lock));
+    int count = runner->parked_count;
+    for (int i = 0; i < count; i++) {
+        runner->polled[i] = runner->parked[i];
+        runner->poll_fds[i].fd = fileno(runner->parked[i]->input);
+        runner->poll_fds[i].events = POLLIN;
+        runner->poll_fds[i].revents = 0;
+    }
+    pthread_mutex_unlock(&(runner->lock));
+
+    if (poll(runner->poll_fds, count, timeout) > 0) {
+        pthread_mutex_lock(&(runner->lock));
+        for (int i = 0; i < count; i++) {
+            if (runner->poll_fds[i].revents == 0) {
+                continue;
+            }
+            for (int j = 0; j < runner->parked_count; j++) {
+                if (runner->parked[j] == runner->polled[i]) {
+                    runner->parked[j] = runner->parked[--runner->parked_count];
+                    break;
+                }
+            }
+            push_job(queue, runner->polled[i]);
         }
+        pthread_mutex_unlock(&(runner->lock));
     }
-    if (rd != 0) {
-        vm->registers[rd] = value;
-    }
+    pthread_mutex_unlock(&(runner->poll_lock));
 }
 
-// Memory operations
-void lb(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    int address = vm->registers[rs1] + imm;
-    int remainder = address % 4;
+void* run_batch_worker(void* argument) {
+    BatchWorker* worker = argument;
+    BatchRunner* runner = worker->runner;
+    JobQueue* queue = &(runner->queues[worker->index]);
 
-    if (address >= 0 && address <= 1023) {
-        address = address / 4;
-        int last_bits = bit8_shift(remainder, vm->instruction_memory[address] & 0xFF);
-        if (rd != 0) {
-            vm->registers[rd] = sext(last_bits);
+    for (unsigned int round = 1;; round++) {
+        if (round % BATCH_POLL_INTERVAL == 0) {
+            unpark_jobs(runner, queue, 0);
         }
-    } else if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        int last_bits = bit8_shift(remainder, vm->data_memory[address] & 0xFF);
-        if (rd != 0) {
-            vm->registers[rd] = sext(last_bits);
+        BatchJob* job = take_job(queue, 0);
+        for (int i = 1; job == NULL && i < runner->worker_count; i++) {
+            job = take_job(&(runner->queues[(worker->index + i) % runner->worker_count]), 1);
         }
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rd);
-    } else {
-		vm->registers[rd] = get_bank_value(vm, address) & 0xFF;
-	}
-}
-
-void lh(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    int address = vm->registers[rs1] + imm;
-	int next_num = get_next_num(vm, address);
-	int remainder = address % 4;
-
-    if (address >= 0 && address <= 1023) {
-        address = address / 4;
-        int last_bits = bit16_shift(remainder, vm->instruction_memory[address] & 0xFFFF, next_num);
-        if (rd != 0) {
-            vm->registers[rd] = sext(last_bits);
+        if (job != NULL) {
+            run_batch_quantum(runner, job, queue);
+            continue;
         }
-    } else if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        int last_bits = bit16_shift(remainder, vm->data_memory[address] & 0xFFFF, next_num);
-        if (rd != 0) {
-            vm->registers[rd] = sext(last_bits);
-        }
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rd);
-    } else {
-		vm->registers[rd] = get_bank_value(vm, address) & 0xFFFF;
-	}
-}
 
-void lw(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    int address = vm->registers[rs1] + imm;
-    int next_num = get_next_num(vm, address);
-    int remainder = address % 4;
-
-    if (address >= 0 && address <= 1023) {
-        address = address / 4;
-        int last_bits = bit32_shift(remainder, vm->instruction_memory[address], next_num);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
-        }
-    } else if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        int last_bits = bit32_shift(remainder, vm->data_memory[address], next_num);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
+        pthread_mutex_lock(&(runner->lock));
+        int remaining = runner->remaining;
+        pthread_mutex_unlock(&(runner->lock));
+        if (remaining == 0) {
+            return NULL;
         }
-    } else if (address >= 2048 && address <= 2303) {
-		if (address >= 2070) {
-            address -= 2;
-            remainder = address % 4;
-        }
-		int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rd);
-    } else {
-		vm->registers[rd] = get_bank_value(vm, address);
-	}
+        unpark_jobs(runner, queue, 10);
+    }
 }
 
-void lbu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    int address = vm->registers[rs1] + imm;
-    int remainder = address % 4;
+int read_batch_manifest(BatchRunner* runner, const char* manifest_path) {
+    FILE* manifest = fopen(manifest_path, "r");
+    char line[3 * 4096];
+    int capacity = 0;
 
-    if (address >= 0 && address <= 1023) {
-        address = address / 4;
-        unsigned int last_bits = bit8_shift(remainder, (unsigned int) vm->instruction_memory[address]);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
-        }
-    } else if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        unsigned int last_bits = bit8_shift(remainder, (unsigned int) vm->data_memory[address]);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
+    if (manifest == NULL) {
+        perror("error opening manifest");
+        return 0;
+    }
+    for (int line_number = 1; fgets(line, sizeof(line), manifest) != NULL; line_number++) {
+        char* image_path = strtok(line, " \t\r\n");
+        char* input_path = strtok(NULL, " \t\r\n");
+        char* output_path = strtok(NULL, " \t\r\n");
+        if (image_path == NULL || image_path[0] == '#') {
+            continue;
         }
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rd);
-    } else {
-		vm->registers[rd] = (unsigned int) (get_bank_value(vm, address) & 0xFF);
-	}
-}
-
-void lhu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    int address = vm->registers[rs1] + imm;
-    int nextNum = get_next_num(vm, address);
-    int remainder = address % 4;
-
-    if (address >= 0 && address <= 1023) {
-        address = address / 4;
-        unsigned int last_bits = bit16_shift(remainder, (unsigned int) vm->instruction_memory[address], nextNum);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
+        if (output_path == NULL) {
+            fprintf(stderr, "%s:%d: expected <image> <input> <output>\n", manifest_path, line_number);
+            fclose(manifest);
+            return 0;
         }
-    } else if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        unsigned int last_bits = bit16_shift(remainder, (unsigned int) vm->data_memory[address], nextNum);
-        if (rd != 0) {
-            vm->registers[rd] = last_bits;
+        if (runner->job_count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            runner->jobs = realloc(runner->jobs, capacity * sizeof(BatchJob));
         }
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rd);
-    } else {
-		vm->registers[rd] = (unsigned int) (get_bank_value(vm, address) & 0xFFFF);
-	}
+        BatchJob* job = &(runner->jobs[runner->job_count++]);
+        memset(job, 0, sizeof(*job));
+        job->image_path = strdup(image_path);
+        job->input_path = strdup(input_path);
+        job->output_path = strdup(output_path);
+        job->status = 1;
+    }
+    fclose(manifest);
+    return 1;
 }
 
-void sb(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
-    int address = vm->registers[rs1] + imm;
-	int remainder = address % 4;
-
-    if (address >= 1024 && address <= 2047) {
-        address = (address - 1024) / 4;
-        int new_value = bit8_store(remainder, vm->data_memory[address], vm->registers[rs2]);
-        vm->data_memory[address] = new_value;
-		
-	} else if (address == 2096) {
-		my_malloc(vm, vm->registers[rs2] && 0xFF);
-    } else if (address == 2100) {
-		my_free(vm, vm->registers[rs2] && 0xFF);
-
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rs2);
-    } else {
-		set_bank_value(vm, address, vm->registers[rs2] && 0xFF);
-	}
-}
+// Returns 0 if every job halted normally
+int run_batch(const char* manifest_path, int thread_count, BatchRunner* runner) {
+    if (!read_batch_manifest(runner, manifest_path)) {
+        return 1;
+    }
+    int job_count = runner->job_count > 0 ? runner->job_count : 1;
+    runner->worker_count = thread_count < job_count ? thread_count : job_count;
+    runner->queues = calloc(runner->worker_count, sizeof(JobQueue));
+    runner->parked = calloc(job_count, sizeof(BatchJob*));
+    runner->polled = calloc(job_count, sizeof(BatchJob*));
+    runner->poll_fds = calloc(job_count, sizeof(struct pollfd));
+    runner->remaining = runner->job_count;
+    pthread_mutex_init(&(runner->lock), NULL);
+    pthread_mutex_init(&(runner->poll_lock), NULL);
+    for (int i = 0; i < runner->worker_count; i++) {
+        pthread_mutex_init(&(runner->queues[i].lock), NULL);
+        runner->queues[i].jobs = calloc(job_count, sizeof(BatchJob*));
+        runner->queues[i].capacity = job_count;
+    }
+    for (int i = 0; i < runner->job_count; i++) {
+        push_job(&(runner->queues[i % runner->worker_count]), &(runner->jobs[i]));
+    }
+
+    BatchWorker* workers = calloc(runner->worker_count, sizeof(BatchWorker));
+    int started = 0;
+    for (int i = 0; i < runner->worker_count; i++) {
+        workers[i].runner = runner;
+        workers[i].index = i;
+    }
+    while (started < runner->worker_count && pthread_create(&(workers[started].thread), NULL, run_batch_worker, &workers[started]) == 0) {
+        started++;
+    }
+    // Workers steal, so any that did start will get through every job
+    if (started == 0) {
+        run_batch_worker(&workers[0]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < runner->job_count; i++) {
+        BatchJob* job = &(runner->jobs[i]);
+        printf("%s %s %d\n", job->image_path, job->output_path, job->status);
+        failed |= job->status != 0;
+        free(job->image_path);
+        free(job->input_path);
+        free(job->output_path);
+    }
+    for (int i = 0; i < runner->worker_count; i++) {
+        pthread_mutex_destroy(&(runner->queues[i].lock));
+        free(runner->queues[i].jobs);
+    }
+    pthread_mutex_destroy(&(runner->lock));
+    pthread_mutex_destroy(&(runner->poll_lock));
+    free(workers);
+    free(runner->queues);
+    free(runner->parked);
+    free(runner->polled);
+    free(runner->poll_fds);
+    free(runner->jobs);
+    return failed;
+}
+#endif
+
+// Event loop
+//
+// --listen serves the image on a TCP port, one VM per connection, from a
+// single thread. A session's input and output are its non-blocking socket.
+// Runnable sessions take turns a quantum at a time, and one that needs
+// input or has a buffer of output the client hasn't read yet is parked
+// until epoll reports the socket ready. A session that halts is closed once
+// its output has drained.
+#if defined(EVENT_LOOP)
+#define SERVER_BACKLOG 128
+#define SERVER_EVENTS 256
+#define SERVER_QUANTUM 20000
+
+enum session_state {
+    SESSION_RUNNABLE, SESSION_PARKED, SESSION_DRAINING
+};
 
-void sh(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
-    int address = vm->registers[rs1] + imm;
-	int remainder = address % 4;	
-
-    if (address >= 1024 && address <= 2046) {
-		int use_var_2s = 0;
-		int value1 = 0;
-		int value2 = 0;
-		int num1 = vm->registers[rs2];
-		int num2 = 0;
-		int* next_address;
-		
-		if (address < 2047 && remainder <= 0) {
-			use_var_2s = 1;
-			next_address = &(vm->data_memory[((int) address / 4) - 1]);
-		}
-
-        address = (address - 1024) / 4;
-		bit16_store(remainder, num1, num2, vm->registers[rs2], &value1, &value2);
-        vm->data_memory[address] = value1;
-		if  (use_var_2s == 1) {
-			*next_address = value2;
-		}
-	
-	} else if (address == 2096) {
-		my_malloc(vm, vm->registers[rs2] && 0xFFFF);
-    } else if (address == 2100) {
-		my_free(vm, vm->registers[rs2] && 0xFFFF);
-		
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rs2);
-    } else {
-		set_bank_value(vm, address, vm->registers[rs2] && 0xFFFF);
-	}
-}
+struct session {
+    VirtualMachine* vm;
+    FILE* stream; // the connection, read and written through its fd
+    uint8_t state;
+    uint8_t reason; // why a parked session stopped
+    struct session* next; // in the run queue
+};
+typedef struct session Session;
+
+struct server {
+    int epoll_fd;
+    int listen_fd;
+    uint8_t image[2048]; // loaded once for every session
+    int64_t quantum;
+    uint8_t jit_enabled;
+    size_t output_buffer_size;
+    Session* run_front;
+    Session* run_back;
+};
+typedef struct server Server;
 
-void sw(VirtualMachine* vm, uint8_t rs1, int imm, uint8_t rs2) {
-    int address = vm->registers[rs1] + imm;
-	int remainder = address % 4;
-
-    if (address >= 1024 && address <= 2044) {
-		int use_var_2s = 0;
-		int value1 = 0;
-		int value2 = 0;
-		int num1 = vm->registers[rs2] & 0xFFFFFFFF;
-		int num2 = 0;
-		int* next_address;
-		
-		if (address >= 2047) {
-			
-		} else if (remainder <= 0) {
-			use_var_2s = 1;
-			next_address = &(vm->data_memory[((int) address / 4) - 1]);
-		}
-
-        address = (address - 1024) / 4;
-		bit32_store(remainder, num1, num2, vm->registers[rs2], &value1, &value2);
-        vm->data_memory[address] = value1;
-		if  (use_var_2s == 1) {
-			*next_address = value2;
-		}
-		
-	} else if (address == 2096) {
-		my_malloc(vm, vm->registers[rs2]);
-    } else if (address == 2100) {
-		my_free(vm, vm->registers[rs2]);
-		
-    } else if (address >= 2048 && address <= 2303) {
-        int index = (address - 2048) / 4;
-        check_virtual_routine(vm, index, rs2);
+void queue_session(Server* server, Session* session) {
+    session->state = SESSION_RUNNABLE;
+    session->next = NULL;
+    if (server->run_back != NULL) {
+        server->run_back->next = session;
     } else {
-		set_bank_value(vm, address, vm->registers[rs2]);
-	}
-}
-
-// Program flow operations
-void slt(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    if (rd != 0) {
-        vm->registers[rd] = (vm->registers[rs1] < vm->registers[rs2]) ? 1 : 0;
+        server->run_front = session;
     }
+    server->run_back = session;
 }
 
-void slti(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = (vm->registers[rs1] < imm) ? 1 : 0;
-    }
+void close_session(Server* server, Session* session) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, fileno(session->stream), NULL);
+    vm_destroy(session->vm);
+    fclose(session->stream);
+    free(session);
 }
 
-void sltu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, uint8_t rs2) {
-    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
-    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
-    if (rd != 0) {
-        vm->registers[rd] = (rs1_value < rs2_value) ? 1 : 0;
-    }
-}
-
-void sltiu(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
-    unsigned int imm_value = (unsigned int) imm;
-    if (rd != 0) {
-        vm->registers[rd] = (rs1_value < imm_value) ? 1 : 0;
-    }
-}
+void accept_sessions(Server* server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            if (errno != EINTR && errno != ECONNABORTED) {
+                return;
+            }
+            continue;
+        }
 
-void beq(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    if (vm->registers[rs1] == vm->registers[rs2]) {
-        vm->program_counter = vm->program_counter + (imm << 1);
-        return;
+        Session* session = calloc(1, sizeof(Session));
+        VirtualMachine* vm = vm_create();
+        FILE* stream = fdopen(fd, "r+b");
+        if (session == NULL || vm == NULL || stream == NULL) {
+            fprintf(stderr, "out of memory for a new session\n");
+            free(session);
+            vm_destroy(vm);
+            if (stream != NULL) {
+                fclose(stream);
+            } else {
+                close(fd);
+            }
+            continue;
+        }
+        vm_load_image(vm, server->image, sizeof(server->image));
+        vm_set_output(vm, stream, server->output_buffer_size, 1);
+        vm_set_input(vm, stream, 1);
+        vm_set_jit(vm, server->jit_enabled);
+        session->vm = vm;
+        session->stream = stream;
+
+        struct epoll_event event = {EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, {.ptr = session}};
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            perror("epoll_ctl");
+            vm_destroy(vm);
+            fclose(stream);
+            free(session);
+            continue;
+        }
+        queue_session(server, session);
     }
-    vm->program_counter += 4;
 }
 
-void bne(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    if (vm->registers[rs1] != vm->registers[rs2]) {
-        vm->program_counter = vm->program_counter + (imm << 1);
-        return;
+// Requeues or closes a session after epoll reported its socket ready
+void wake_session(Server* server, Session* session, uint32_t events) {
+    size_t pending = vm_flush_output(session->vm);
+    if (session->state == SESSION_DRAINING) {
+        if (pending == 0) {
+            close_session(server, session);
+        }
+    } else if (session->state == SESSION_PARKED) {
+        if ((session->reason == STOP_NEEDS_INPUT && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) ||
+            (session->reason == STOP_OUTPUT_FULL && pending < server->output_buffer_size)) {
+            queue_session(server, session);
+        }
     }
-    vm->program_counter += 4;
 }
 
-void blt(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    if (vm->registers[rs1] < vm->registers[rs2]) {
-        vm->program_counter = vm->program_counter + (imm << 1);		
-        return;
+// Runs the session at the front of the run queue for one quantum
+void run_session(Server* server) {
+    Session* session = server->run_front;
+    server->run_front = session->next;
+    if (server->run_front == NULL) {
+        server->run_back = NULL;
     }
-    vm->program_counter += 4;
-}
 
-void bltu(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
-    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
-    unsigned int imm_value = (unsigned int) imm;
-    if (rs1_value < rs2_value) {
-        vm->program_counter = vm->program_counter + (imm_value << 1);
-        return;
+    int reason = vm_run(session->vm, server->quantum);
+    if (reason == STOP_QUANTUM_EXPIRED) {
+        queue_session(server, session);
+    } else if (reason == STOP_NEEDS_INPUT || reason == STOP_OUTPUT_FULL) {
+        session->state = SESSION_PARKED;
+        session->reason = reason;
+    } else if (vm_flush_output(session->vm) == 0) {
+        close_session(server, session);
+    } else {
+        session->state = SESSION_DRAINING;
     }
-    vm->program_counter += 4;
 }
 
-void bge(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    if (vm->registers[rs1] >= vm->registers[rs2]) {
-        vm->program_counter = vm->program_counter + (imm << 1);
-        return;
+int open_listen_socket(int port) {
+    struct sockaddr_in address = {0};
+    int enable = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
-    vm->program_counter += 4;
-}
-
-void bgeu(VirtualMachine* vm, uint8_t rs1, uint8_t rs2, int imm) {
-    unsigned int rs1_value = (unsigned int) vm->registers[rs1];
-    unsigned int rs2_value = (unsigned int) vm->registers[rs2];
-    unsigned int imm_value = (unsigned int) imm;
-    if (rs1_value >= rs2_value) {
-        vm->program_counter = vm->program_counter + (imm_value << 1);
-        return;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        perror("error listening");
+        close(fd);
+        return -1;
     }
-    vm->program_counter += 4;
+    return fd;
 }
 
-void jal(VirtualMachine* vm, uint8_t rd, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->program_counter + 4;
-    }
-    vm->program_counter = vm->program_counter + (imm << 1);
-}
+// Serves until the process is killed, returns 1 if the server can't start
+int run_server(Server* server, int port) {
+    struct epoll_event events[SERVER_EVENTS];
 
-void jalr(VirtualMachine* vm, uint8_t rd, uint8_t rs1, int imm) {
-    if (rd != 0) {
-        vm->registers[rd] = vm->program_counter + 4;
+    // Writing to a connection the client closed is reported as EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    server->listen_fd = open_listen_socket(port);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->listen_fd < 0 || server->epoll_fd < 0) {
+        return 1;
     }
-    vm->program_counter = vm->registers[rs1] + imm;
-}
+    struct epoll_event event = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
 
-// Format types and execute instructions
-void execute_R(VirtualMachine* vm, Instruction* instruction) {
-    uint8_t func7;
-    char func7_binary[8];
-    assign_format_binary(instruction->binary, 0, func7_binary, 8);
-    func7 = (uint8_t) binary_to_decimal(func7_binary);
-
-    uint8_t rs2;
-    char rs2_binary[6];
-    assign_format_binary(instruction->binary, 7, rs2_binary, 6);
-    rs2 = (uint8_t) binary_to_decimal(rs2_binary);
-
-    uint8_t rs1;
-    char rs1_binary[6];
-    assign_format_binary(instruction->binary, 12, rs1_binary, 6);
-    rs1 = (uint8_t) binary_to_decimal(rs1_binary);
-
-    uint8_t func3;
-    char func3_binary[4];
-    assign_format_binary(instruction->binary, 17, func3_binary, 4);
-    func3 = (uint8_t) binary_to_decimal(func3_binary);
-
-    uint8_t rd;
-    char rd_binary[6];
-    assign_format_binary(instruction->binary, 20, rd_binary, 6);
-    rd = (uint8_t) binary_to_decimal(rd_binary);
-
-    if (instruction->opcode == 0b0110011) {
-        // Logic and arithmetic
-        if (func3 == 0b000 && func7 == 0b0000000) {
-            add(vm, rd, rs1, rs2);
-        } else if (func3 == 0b000 && func7 == 0b0100000) {
-            sub(vm, rd, rs1, rs2);
-        } else if (func3 == 0b100 && func7 == 0b0000000) {
-            xor(vm, rd, rs1, rs2);
-        } else if (func3 == 0b110 && func7 == 0b0000000) {
-            or(vm, rd, rs1, rs2);
-        } else if (func3 == 0b111 && func7 == 0b0000000) {
-            and(vm, rd, rs1, rs2);
-        } else if (func3 == 0b001 && func7 == 0b0000000) {
-            sll(vm, rd, rs1, rs2);
-        } else if (func3 == 0b101 && func7 == 0b0000000) {
-            srl(vm, rd, rs1, rs2);
-        } else if (func3 == 0b101 && func7 == 0b0100000) {
-            sra(vm, rd, rs1, rs2);
-        // Program flow
-        } else if (func3 == 0b010 && func7 == 0b0000000) {
-            slt(vm, rd, rs1, rs2);
-        } else if (func3 == 0b011 && func7 == 0b0000000) {
-            sltu(vm, rd, rs1, rs2);
+    for (;;) {
+        int count = epoll_wait(server->epoll_fd, events, SERVER_EVENTS, server->run_front != NULL ? 0 : -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_sessions(server);
+            } else {
+                wake_session(server, events[i].data.ptr, events[i].events);
+            }
+        }
+        // Every session runnable now gets one quantum before polling again
+        Session* last = server->run_back;
+        while (server->run_front != NULL) {
+            Session* session = server->run_front;
+            run_session(server);
+            if (session == last) {
+                break;
+            }
         }
-		vm->program_counter += 4;
     }
 }
+#endif
 
-int set_imm_sign(char* imm_binary) {
-	char sign = convert_twos_complement(imm_binary);
-    int imm = binary_to_decimal(imm_binary);
-    if (sign == '-') {
-        imm *= -1;
-    }
-	return imm;
+// Every way the command line can be put together
+void print_usage(const char* program) {
+    fprintf(stderr, "usage: %s [--jit | --no-jit] [--jit-stats] [--profile] [--stats=json] [--call-graph <folded.txt>] [--symbols <map>] [--trace <file.trace> [--trace-size <instructions>]] [--output-buffer <bytes>] [--input <file>] [--persistent] [--cache-dir <dir>] [--aot <output.c>] <image.mi>\n", program);
+    fprintf(stderr, "       %s [options] [--snapshot-at <instructions> | --snapshot-at pc=<address>] [--snapshot <file.snap>] <image.mi>\n", program);
+    fprintf(stderr, "       %s [options] --restore <file.snap>\n", program);
+    fprintf(stderr, "       %s --print-trace <file.trace>\n", program);
+    fprintf(stderr, "       %s [--input <file>] [--cache-dir <dir>] [--restore <file.snap>] --fork-server [<image.mi>]\n", program);
+    fprintf(stderr, "       %s [--jit | --no-jit] [--output-buffer <bytes>] [--cache-dir <dir>] --lockstep <manifest> <image.mi>\n", program);
+    fprintf(stderr, "       %s [--jit | --no-jit] [--output-buffer <bytes>] [--cache-dir <dir>] --batch <manifest> [--jobs <threads>] [--quantum <instructions>]\n", program);
+    fprintf(stderr, "       %s [--jit | --no-jit] [--output-buffer <bytes>] [--cache-dir <dir>] --listen <port> [--quantum <instructions>] <image.mi>\n", program);
 }
 
-void execute_I(VirtualMachine* vm, Instruction* instruction) {
-    char imm_binary[13];
-    assign_format_binary(instruction->binary, 0, imm_binary, 13);
-    int imm = set_imm_sign(imm_binary);
-
-    uint8_t rs1;
-    char rs1_binary[6];
-    assign_format_binary(instruction->binary, 12, rs1_binary, 6);
-    rs1 = (uint8_t) binary_to_decimal(rs1_binary);
-
-    uint8_t func3;
-    char func3_binary[4];
-    assign_format_binary(instruction->binary, 17, func3_binary, 4);
-    func3 = (uint8_t) binary_to_decimal(func3_binary);
-
-    uint8_t rd;
-    char rd_binary[6];
-    assign_format_binary(instruction->binary, 20, rd_binary, 6);
-    rd = (uint8_t) binary_to_decimal(rd_binary);
-
-    // Logic and arithmetic
-    if (instruction->opcode == 0b0010011) {
-        if (func3 == 0b000) {
-            addi(vm, rd, rs1, imm);
-		} else if (func3 == 0b100) {
-            xori(vm, rd, rs1, imm);
-        } else if (func3 == 0b110) {
-            ori(vm, rd, rs1, imm);
-        } else if (func3 == 0b111) {
-            andi(vm, rd, rs1, imm);
-        // Program flow
-        } else if (func3 == 0b010) {
-            slti(vm, rd, rs1, imm);
-        } else if (func3 == 0b011) {
-            sltiu(vm, rd, rs1, imm);
-        }
-		vm->program_counter += 4;
-    // Memory
-    } else if (instruction->opcode == 0b0000011) {
-        if (func3 == 0b000) {
-            lb(vm, rd, rs1, imm);
-        } else if (func3 == 0b001) {
-            lh(vm, rd, rs1, imm);
-        } else if (func3 == 0b010) {
-            lw(vm, rd, rs1, imm);
-        } else if (func3 == 0b100) {
-            lbu(vm, rd, rs1, imm);
-        } else if (func3 == 0b101) {
-            lhu(vm, rd, rs1, imm);
-        }
-		vm->program_counter += 4;
-    // Program flow
-    } else if (instruction->opcode == 0b1100111) {
-        if (func3 == 0b000) {
-            jalr(vm, rd, rs1, imm);
+int main(int argc, char* argv[]) {
+    char *file_path = NULL;
+    uint8_t jit_enabled = 0; // Like the library, the JIT is opt-in with --jit
+    uint8_t jit_requested = 0;
+    uint8_t jit_stats = 0;
+    uint8_t profile = 0;
+    uint8_t stats = 0;
+    char *call_graph_path = NULL;
+    char *symbols_path = NULL;
+    char *trace_path = NULL;
+    size_t trace_size = TRACE_SIZE;
+    char *print_trace_path = NULL;
+    char *aot_path = NULL;
+    size_t output_buffer_size = OUTPUT_BUFFER_SIZE;
+    char *input_path = NULL;
+    char *cache_directory = getenv("RISKXVII_CACHE_DIR");
+    char *batch_path = NULL;
+    int thread_count = 0;
+    long long quantum = -1;
+    int port = 0;
+    uint8_t persistent = 0;
+    char *snapshot_point = NULL;
+    char *snapshot_path = NULL;
+    char *restore_path = NULL;
+    uint8_t fork_server = 0;
+    char *lockstep_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc) {
+            aot_path = argv[++i];
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit_enabled = 1;
+            jit_requested = 1;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jit_enabled = 0;
+        } else if (strcmp(argv[i], "--jit-stats") == 0) {
+            jit_stats = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--call-graph") == 0 && i + 1 < argc) {
+            call_graph_path = argv[++i];
+        } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symbols_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) {
+            trace_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--print-trace") == 0 && i + 1 < argc) {
+            print_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc) {
+            output_buffer_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_directory = argv[++i];
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+            quantum = strtoll(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--persistent") == 0) {
+            persistent = 1;
+        } else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) {
+            snapshot_point = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc) {
+            lockstep_path = argv[++i];
+        } else if (strcmp(argv[i], "--fork-server") == 0) {
+            fork_server = 1;
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            // Unknown, or missing its argument
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            file_path = argv[i];
         }
     }
-}
-
-void execute_S(VirtualMachine* vm, Instruction* instruction) {
-    char imm_binary[13];	
-    assign_format_binary(instruction->binary, 0, imm_binary, 7+1);
-    assign_format_binary(instruction->binary , 20, imm_binary + 7, 5+1);
-    int imm = set_imm_sign(imm_binary);
-
-    uint8_t rs2;
-    char rs2_binary[6];
-    assign_format_binary(instruction->binary, 7, rs2_binary, 6);
-    rs2 = (uint8_t) binary_to_decimal(rs2_binary);
-
-    uint8_t rs1;
-    char rs1_binary[6];
-    assign_format_binary(instruction->binary, 12, rs1_binary, 6);
-    rs1 = (uint8_t) binary_to_decimal(rs1_binary);
-
-    uint8_t func3;
-    char func3_binary[4];
-    assign_format_binary(instruction->binary, 17, func3_binary, 4);
-    func3 = (uint8_t) binary_to_decimal(func3_binary);
-
-    if (instruction->opcode == 0b0100011) {
-        if (func3 == 0b000) {
-            sb(vm, rs1, imm ,rs2);
-        } else if (func3 == 0b001) {
-            sh(vm, rs1, imm ,rs2);
-        } else if (func3 == 0b010) {
-            sw(vm, rs1, imm ,rs2);
-        }
-		vm->program_counter += 4;
+    if (print_trace_path != NULL) {
+        return vm_print_trace(print_trace_path, stdout) ? 0 : 1;
     }
-}
-
-void execute_SB(VirtualMachine* vm, Instruction* instruction) {
-    char imm_binary[13];	
-    assign_format_binary(instruction->binary, 0, imm_binary, 1+1);
-    assign_format_binary(instruction->binary, 24, imm_binary + 1, 1+1);
-    assign_format_binary(instruction->binary, 1, imm_binary + 2, 6+1);
-    assign_format_binary(instruction->binary, 20, imm_binary + 8, 4+1);
-	int imm = set_imm_sign(imm_binary);
-
-    uint8_t rs2;
-    char rs2_binary[6];
-    assign_format_binary(instruction->binary, 7, rs2_binary, 6);
-    rs2 = (uint8_t) binary_to_decimal(rs2_binary);
-
-    uint8_t rs1;
-    char rs1_binary[6];
-    assign_format_binary(instruction->binary, 12, rs1_binary, 6);
-    rs1 = (uint8_t) binary_to_decimal(rs1_binary);
-
-    uint8_t func3;
-    char func3_binary[4];
-    assign_format_binary(instruction->binary, 17, func3_binary, 4);
-    func3 = (uint8_t) binary_to_decimal(func3_binary);
-
-    if (instruction->opcode == 0b1100011) {
-        if (func3 == 0b000) {
-            beq(vm, rs1, rs2, imm);
-        } else if (func3 == 0b001) {
-            bne(vm, rs1, rs2, imm);
-        } else if (func3 == 0b100) {
-            blt(vm, rs1, rs2, imm);
-        } else if (func3 == 0b110) {
-            bltu(vm, rs1, rs2, imm);
-        } else if (func3 == 0b101) {
-            bge(vm, rs1, rs2, imm);
-        } else if (func3 == 0b111) {
-            bgeu(vm, rs1, rs2, imm);
+    // A restored snapshot brings its own image
+    if (file_path == NULL && batch_path == NULL && (restore_path == NULL || port > 0 || aot_path != NULL || lockstep_path != NULL)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (lockstep_path != NULL) {
+        return run_lockstep(lockstep_path, file_path, jit_enabled, output_buffer_size, cache_directory);
+    }
+    if (batch_path != NULL) {
+#if defined(BATCH_THREADS)
+        BatchRunner runner = {0};
+        runner.jit_enabled = jit_enabled;
+        runner.output_buffer_size = output_buffer_size;
+        runner.cache_directory = cache_directory;
+        runner.quantum = quantum >= 0 ? quantum : BATCH_QUANTUM;
+        if (thread_count <= 0) {
+            thread_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
         }
+        return run_batch(batch_path, thread_count > 0 ? thread_count : 1, &runner);
+#else
+        fprintf(stderr, "--batch is not supported on this platform\n");
+        return 1;
+#endif
     }
-}
-
-void execute_U(VirtualMachine* vm, Instruction* instruction) {
-    char imm_binary[21];
-    assign_format_binary(instruction->binary, 0, imm_binary, 21);
-    int imm = set_imm_sign(imm_binary);
 
-    uint8_t rd;
-    char rd_binary[6];
-    assign_format_binary(instruction->binary, 20, rd_binary, 6);
-    rd = (uint8_t) binary_to_decimal(rd_binary);
-
-    if (instruction->opcode == 0b0110111) {
-        lui(vm, rd, imm);
-		vm->program_counter += 4;
+    // Initialise the VM
+    VirtualMachine* vm = vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
     }
-}
-
-void execute_UJ(VirtualMachine* vm, Instruction* instruction) {
-    char imm_binary[21];
-    assign_format_binary(instruction->binary, 0, imm_binary, 1+1);
-    assign_format_binary(instruction->binary, 12, imm_binary + 1, 8+1);
-    assign_format_binary(instruction->binary, 11, imm_binary + 9, 1+1);
-    assign_format_binary(instruction->binary, 1, imm_binary + 10, 10+1);
-	int imm = set_imm_sign(imm_binary);
-
-    uint8_t rd;
-    char rd_binary[6];
-    assign_format_binary(instruction->binary, 20, rd_binary, 6);
-    rd = (uint8_t) binary_to_decimal(rd_binary);
-
-    if (instruction->opcode == 0b1101111) {
-        jal(vm, rd, imm);
+    vm_set_cache_directory(vm, cache_directory);
+    if (restore_path == NULL && !vm_load_image_file(vm, file_path)) {
+        return 1;
     }
-}
-
-// Execute instructions
-int execute_instructions(VirtualMachine* vm) {
-    while (1) {
-        Instruction instruction;
 
-        int num = vm->instruction_memory[vm->program_counter / 4];
-        decimal_to_binary(instruction.binary, num);
+    if (port > 0) {
+#if defined(EVENT_LOOP)
+        Server server = {0};
+        vm_read_memory(vm, 0, server.image, sizeof(server.image));
+        server.quantum = quantum >= 0 ? quantum : SERVER_QUANTUM;
+        server.jit_enabled = jit_enabled;
+        server.output_buffer_size = output_buffer_size;
+        return run_server(&server, port);
+#else
+        fprintf(stderr, "--listen is not supported on this platform\n");
+        return 1;
+#endif
+    }
 
-        char opcode_binary[8];
-        opcode_binary[7] = '\0';
-        for (int j = 25; j <= 31; j++) {
-            opcode_binary[j - 25] = instruction.binary[j];
+    if (aot_path != NULL) {
+        FILE* out = strcmp(aot_path, "-") == 0 ? stdout : fopen(aot_path, "w");
+        if (out == NULL) {
+            perror("error opening output file");
+            return 1;
         }
-        instruction.opcode = (uint8_t) strtoul(opcode_binary, NULL, 2);
-
-        if (instruction.opcode > 0) {
-            get_instruction_type(&instruction);
-
-            if (strcmp(instruction.type, "R") == 0) {
-                execute_R(vm, &instruction);
-            } else if (strcmp(instruction.type, "I") == 0) {
-                execute_I(vm, &instruction);
-            } else if (strcmp(instruction.type, "S") == 0) {
-                execute_S(vm, &instruction);
-            } else if (strcmp(instruction.type, "SB") == 0) {
-                execute_SB(vm, &instruction);
-            } else if (strcmp(instruction.type, "U") == 0) {
-                execute_U(vm, &instruction);
-            } else if (strcmp(instruction.type, "UJ") == 0) {
-                execute_UJ(vm, &instruction);
-            } else {
-                fake_instruction(vm, num);
-				return 1;
-            }
-        } else {
-			fake_instruction(vm, num);
-			return 1;
-		}
-    }	
-	return 0;
-}
+        vm_translate(vm, out, file_path);
+        return fclose(out) == 0 ? 0 : 1;
+    }
 
-int main(int argc, char* argv[]) {
-    // Open file 
-    char *file_path = argv[1];
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL) {
-        perror("error opening file");
+    FILE* input = input_path != NULL ? fopen(input_path, "rb") : stdin;
+    if (input == NULL) {
+        perror("error opening input file");
+        return 1;
+    }
+    vm_set_input(vm, input, 0);
+    vm_set_output(vm, stdout, output_buffer_size, 0);
+    if (profile && !vm_set_profiling(vm, 1)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (trace_path != NULL && !vm_set_trace(vm, trace_size > 0 ? trace_size : 1)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (stats && !vm_set_stats(vm, stderr)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (!vm_set_jit(vm, jit_enabled) && jit_requested && !profile && !stats && call_graph_path == NULL && trace_path == NULL) {
+        fprintf(stderr, "JIT not supported on this platform, interpreting\n");
+    }
+    if (restore_path != NULL && persistent) {
+        // Every record starts from the snapshot with only its own input
+        vm_set_input_buffer(vm, "", 0);
+    }
+    if (restore_path != NULL && !vm_restore_snapshot(vm, restore_path)) {
+        return 1;
+    }
+    // The call graph is rooted where the program starts
+    if (call_graph_path != NULL && (!vm_set_call_graph(vm, 1) || (symbols_path != NULL && !vm_load_symbols(vm, symbols_path)))) {
         return 1;
     }
 
-    // Initialise the VM
-    VirtualMachine vm = {0, {0}};
-	for (int i = 0; i < 128; i++) {
-		HeapMemory new_memory;
-		new_memory.first_bank = 255;
-		new_memory.banks_used = 0;
-		new_memory.value = 0;
-		new_memory.next = 0;
-		vm.heap_banks[i] = new_memory;
-	}
-
-    // Read binary file
-    unsigned char c;
-    unsigned int num = 0;
-    int line_count = 0;
-    int total_count = 0;
-
-    while (fread(&c, sizeof(unsigned char), 1, file) == 1) {
-        num = num | ((unsigned int)c << (line_count * 8));
-        line_count++;
-
-        if (line_count == 4) {
-            // Store instruction to instruction_memory 
-            if (total_count < 1024) {
-                int index = (total_count) / 4;
-                vm.instruction_memory[index] = num;
-            } else {
-                int index = (total_count - 1024) / 4;
-                vm.data_memory[index] = num;
-            }
+    if (fork_server) {
+#if defined(FORK_SERVER)
+        // Each test input is what the program reads from the restored point on
+        int status = run_fork_server(vm, input_path);
+        vm_destroy(vm);
+        return status;
+#else
+        fprintf(stderr, "--fork-server is not supported on this platform\n");
+        return 1;
+#endif
+    }
 
-            num = 0;
-            line_count = 0;
+    if (snapshot_point != NULL) {
+        char default_path[4096];
+        if (persistent) {
+            fprintf(stderr, "--snapshot-at can't be combined with --persistent\n");
+            return 1;
+        }
+        if (snapshot_path == NULL) {
+            snprintf(default_path, sizeof(default_path), "%s.snap", file_path != NULL ? file_path : restore_path);
+            snapshot_path = default_path;
+        }
+        int reason = run_to_snapshot(vm, snapshot_point, snapshot_path);
+        if (reason < 0) {
+            return 1;
+        } else if (reason == STOP_HALTED || reason == STOP_ERROR) {
+            int status = vm_get_exit_status(vm);
+            vm_destroy(vm);
+            return status;
         }
-
-        total_count++;
     }
 
-    int success = execute_instructions(&vm);
-
-    fclose(file);
+    int success = persistent ? run_records(vm, input) : run_to_completion(vm);
+    if (jit_stats) {
+        vm_print_jit_stats(vm);
+    }
+    if (profile) {
+        vm_print_profile(vm);
+    }
+    if (call_graph_path != NULL && !write_call_graph(vm, call_graph_path)) {
+        success = 1;
+    }
+    if (trace_path != NULL && !vm_write_trace(vm, trace_path)) {
+        success = 1;
+    }
+    vm_destroy(vm);
 
 	return success;
-}
\ No newline at end of file
+}